@@ -7,8 +7,13 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace application {
 
@@ -227,11 +232,19 @@ inline auto destroy_window( graphics::Window& window ) {
     window.id = nullptr;
 }
 
-inline auto process_window( graphics::Window& window ) {
+inline auto swap_window( graphics::Window& window ) {
     glfwSwapBuffers( window.id );
+}
+
+inline auto poll_window_events( ) {
     glfwPollEvents( );
 }
 
+inline auto process_window( graphics::Window& window ) {
+    swap_window( window );
+    poll_window_events( );
+}
+
 inline auto is_window_closed( graphics::Window& window ) noexcept -> bool {
     return glfwWindowShouldClose( window.id );
 }
@@ -288,9 +301,206 @@ namespace utility {
         std::atomic_bool _done = false;
     };
 
+    // Owns the GL context of the window and presents frames handed over by the main thread
+    template <typename Frame> class RenderThread {
+    public:
+        RenderThread( ) = default;
+        ~RenderThread( ) {
+            stop( );
+        }
+
+        RenderThread( const RenderThread& ) = delete;
+        auto operator=( const RenderThread& ) -> RenderThread& = delete;
+
+        // Must be called from the thread owning the context, which gets released
+        template <typename OnRender>
+        auto start( graphics::Window window, size_t num_frames, OnRender on_render ) -> void {
+            _frames.resize( std::max( num_frames, size_t { 2 } ) );
+            _submitted = 0;
+            _rendered = 0;
+            _stop = false;
+
+            glfwMakeContextCurrent( nullptr );
+
+            _thread = std::thread( [this, window, on_render]( ) mutable {
+                glfwMakeContextCurrent( window.id );
+
+                for ( ;; ) {
+                    size_t index = 0;
+                    {
+                        std::unique_lock lock { _mutex };
+                        _cv.wait( lock, [this]( ) { return _stop || _submitted != _rendered; } );
+                        if ( _submitted == _rendered )
+                            break;
+
+                        index = _rendered % _frames.size( );
+                    }
+
+                    on_render( _frames[index] );
+                    swap_window( window );
+
+                    {
+                        std::lock_guard lock { _mutex };
+                        _rendered++;
+                    }
+
+                    _cv.notify_all( );
+                }
+
+                glfwMakeContextCurrent( nullptr );
+            } );
+        }
+
+        // Renders the remaining frames and releases the context
+        auto stop( ) -> void {
+            if ( !_thread.joinable( ) )
+                return;
+
+            {
+                std::lock_guard lock { _mutex };
+                _stop = true;
+            }
+
+            _cv.notify_all( );
+            _thread.join( );
+        }
+
+        auto is_running( ) const noexcept -> bool {
+            return _thread.joinable( );
+        }
+
+        // Next frame to record, blocks while every frame is in flight
+        auto acquire( ) -> Frame& {
+            std::unique_lock lock { _mutex };
+            _cv.wait( lock, [this]( ) { return _submitted - _rendered < _frames.size( ); } );
+            return _frames[_submitted % _frames.size( )];
+        }
+
+        auto submit( ) -> void {
+            {
+                std::lock_guard lock { _mutex };
+                _submitted++;
+            }
+
+            _cv.notify_all( );
+        }
+
+    private:
+        std::vector<Frame> _frames;
+        std::thread _thread;
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        uint64_t _submitted = 0;
+        uint64_t _rendered = 0;
+        bool _stop = false;
+    };
+
+    class ThreadPool {
+    public:
+        explicit ThreadPool( size_t num_workers = std::max( std::thread::hardware_concurrency( ), 2u ) - 1 ) {
+            for ( size_t i = 0; i < num_workers; i++ ) {
+                _workers.emplace_back( [this]( ) { worker( ); } );
+            }
+        }
+
+        ~ThreadPool( ) {
+            {
+                std::lock_guard lock { _mutex };
+                _stop = true;
+            }
+
+            _wake.notify_all( );
+
+            for ( auto& w : _workers ) {
+                w.join( );
+            }
+        }
+
+        ThreadPool( const ThreadPool& ) = delete;
+        auto operator=( const ThreadPool& ) -> ThreadPool& = delete;
+
+        auto size( ) const noexcept -> size_t {
+            return _workers.size( ) + 1;
+        }
+
+        // Calls f( index ) for every index in [0, count), the calling thread takes part, returns when all are done
+        template <typename F> auto parallel_for( size_t count, F&& f ) -> void {
+            if ( count == 0 )
+                return;
+
+            std::function<void( size_t )> job = std::forward<F>( f );
+
+            {
+                // Late workers of the previous call may still be leaving execute( )
+                std::unique_lock lock { _mutex };
+                _done.wait( lock, [this]( ) { return _active == 0; } );
+                _job = &job;
+                _count = count;
+                _next = 0;
+                _pending = count;
+                _generation++;
+            }
+
+            _wake.notify_all( );
+
+            execute( );
+
+            std::unique_lock lock { _mutex };
+            _done.wait( lock, [this]( ) { return _pending == 0 && _active == 0; } );
+            _job = nullptr;
+        }
+
+    private:
+        auto worker( ) -> void {
+            uint64_t generation = 0;
+
+            for ( ;; ) {
+                {
+                    std::unique_lock lock { _mutex };
+                    _wake.wait( lock, [&]( ) { return _stop || _generation != generation; } );
+                    if ( _stop )
+                        return;
+
+                    generation = _generation;
+                    _active++;
+                }
+
+                execute( );
+
+                {
+                    std::lock_guard lock { _mutex };
+                    _active--;
+                }
+
+                _done.notify_all( );
+            }
+        }
+
+        auto execute( ) -> void {
+            for ( size_t i = _next++; i < _count; i = _next++ ) {
+                ( *_job )( i );
+                _pending--;
+            }
+        }
+
+        std::vector<std::thread> _workers;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+        std::function<void( size_t )>* _job = nullptr;
+        size_t _count = 0;
+        std::atomic_size_t _next = 0;
+        std::atomic_size_t _pending = 0;
+        size_t _active = 0;
+        uint64_t _generation = 0;
+        bool _stop = false;
+    };
+
 } // namespace utility
 
 using Mainloop = utility::Mainloop;
+using ThreadPool = utility::ThreadPool;
+template <typename Frame> using RenderThread = utility::RenderThread<Frame>;
 using Window = graphics::Window;
 using CreateWindowInfo = graphics::CreateWindowInfo;
 
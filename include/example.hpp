@@ -3,12 +3,18 @@
 #include <application.hpp>
 #include <graphics.hpp>
 
+#include <cstdlib>
+
 struct RunExampleAppInfo {
     std::string_view title;
     std::function<void( )> on_init = []( ) {};
     std::function<void( )> on_update = []( ) {};
     std::function<void( int, int )> on_present;
     std::function<void( )> on_cleanup = []( ) {};
+    bool render_thread = false; // Present and swap on a dedicated thread while the next frame is recorded
+    uint32_t frames_in_flight = 2;
+    std::string capture_file = { }; // Writes the first presented frame with its resources, see capture_replay
+    uint32_t gpu_frames_in_flight = 0; // Frames the GPU may lag behind the CPU, 0 leaves pacing to the driver
 };
 
 class ExampleApp {
@@ -18,13 +24,43 @@ public:
     auto operator=( const ExampleApp& ) -> ExampleApp& = delete;
 
     auto run( const RunExampleAppInfo& info ) -> int {
-        return _run( info.title, info.on_init, info.on_update, info.on_present, info.on_cleanup );
+        _capture_file = info.capture_file;
+        if ( const auto env = std::getenv( "EXAMPLE_CAPTURE_FILE" ); env && _capture_file.empty( ) ) {
+            _capture_file = env;
+        }
+
+        _gpu_frames = info.gpu_frames_in_flight;
+        if ( const auto env = std::getenv( "EXAMPLE_GPU_FRAMES" ); env ) {
+            _gpu_frames = static_cast<uint32_t>( std::strtoul( env, nullptr, 10 ) );
+        }
+
+        return _run( info.title, info.render_thread, info.frames_in_flight, info.on_init, info.on_update,
+            info.on_present, info.on_cleanup );
+    }
+
+    // Presents inline, or hands the queues over to the render thread when it is enabled
+    auto present( const graphics::CommandQueues& queues ) -> void {
+        if ( !_render_thread.is_running( ) ) {
+            _capture( queues );
+            _limit_frames( );
+            graphics::present( queues );
+            return;
+        }
+
+        auto& frame = _render_thread.acquire( );
+        frame.capture( queues );
+        _render_thread.submit( );
+    }
+
+    // Time spent waiting for the GPU to catch up, only valid once run has returned or on the presenting thread
+    auto frame_limiter_stats( ) const -> const graphics::FrameLimiterStats& {
+        return _limiter.stats;
     }
 
 private:
     template <typename OnInit, typename OnUpdate, typename OnPresent, typename OnCleanup>
-    auto _run( std::string_view title, OnInit on_init, OnUpdate on_update, OnPresent on_present, OnCleanup on_cleanup )
-        -> int {
+    auto _run( std::string_view title, bool render_thread, uint32_t frames_in_flight, OnInit on_init,
+        OnUpdate on_update, OnPresent on_present, OnCleanup on_cleanup ) -> int {
         using namespace std::literals;
 
         glfwSetErrorCallback(
@@ -43,8 +79,22 @@ private:
         graphics::default_framebuffer.width = window->width;
         graphics::default_framebuffer.height = window->height;
 
+        graphics::enable_capture( !_capture_file.empty( ) );
+
         on_init( );
 
+        if ( _gpu_frames > 0 ) {
+            _limiter = graphics::create_frame_limiter( { .max_frames = _gpu_frames } );
+        }
+
+        if ( render_thread ) {
+            _render_thread.start( *window, frames_in_flight, [this]( graphics::PresentFrame& frame ) {
+                _capture( frame.pointers );
+                _limit_frames( );
+                graphics::present( frame.pointers );
+            } );
+        }
+
         _mainloop.run( std::chrono::milliseconds { 16ms }, on_update, [&]( ) {
             if ( application::is_window_closed( *window ) ) {
                 _mainloop.stop( );
@@ -52,15 +102,58 @@ private:
 
             on_present( window->width, window->height );
 
-            application::process_window( *window );
+            if ( _render_thread.is_running( ) ) {
+                application::poll_window_events( );
+            } else {
+                application::process_window( *window );
+            }
         } );
 
+        if ( _render_thread.is_running( ) ) {
+            _render_thread.stop( );
+            glfwMakeContextCurrent( window->id );
+        }
+
+        if ( _gpu_frames > 0 ) {
+            const auto& stats = _limiter.stats;
+            journal::info( _tag, "{} frames in flight, waited {:.3f} ms/frame on average, {} stalls, worst {:.3f} ms",
+                _limiter.max_frames,
+                std::chrono::duration<double, std::milli>( stats.total_wait ).count( ) /
+                    std::max<uint64_t>( stats.frames, 1 ),
+                stats.stalls, std::chrono::duration<double, std::milli>( stats.worst_wait ).count( ) );
+            graphics::destroy_frame_limiter( _limiter );
+        }
+
         on_cleanup( );
 
         return EXIT_SUCCESS;
     }
 
+    // Called where the context is current, buffer contents are read back
+    auto _capture( const graphics::CommandQueues& queues ) -> void {
+        if ( _capture_file.empty( ) )
+            return;
+
+        if ( graphics::write_capture( _capture_file, queues ) ) {
+            journal::info( _tag, "Frame captured to {}", _capture_file );
+        }
+
+        _capture_file.clear( );
+        graphics::enable_capture( false );
+    }
+
+    // Fences the previous frame before presenting, keeps at most _gpu_frames queued on the GPU
+    auto _limit_frames( ) -> void {
+        if ( _gpu_frames > 0 ) {
+            graphics::limit_frames_in_flight( _limiter );
+        }
+    }
+
     static constexpr std::string_view _tag = "Example";
     application::Window _window;
     application::Mainloop _mainloop;
+    application::RenderThread<graphics::PresentFrame> _render_thread;
+    std::string _capture_file;
+    graphics::FrameLimiter _limiter;
+    uint32_t _gpu_frames = 0;
 };
\ No newline at end of file
@@ -26,7 +26,30 @@
 
 #include <glmath.hpp>
 
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+#if defined( __F16C__ )
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <ranges>
+#include <span>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
@@ -54,16 +77,6 @@ enum class PixelFormat : std::uint32_t {
     depth
 };
 
-enum class VertexFormat : std::uint32_t {
-    unknown,
-    v3_f32,
-    v3_f32ui16,
-    v3n3_f32ui16,
-    v3t2_f32ui16,
-    v3t2n3_f32ui16,
-    v3uv2n3t3_f32ui16
-};
-
 ///
 /// Vertex formats
 ///
@@ -90,6 +103,203 @@ struct v3uv2n3t3_t {
     vec3 tangent;
 };
 
+// Compact components written by quantize_vertices
+struct half2 {
+    uint16_t x, y;
+};
+struct snorm16x3 {
+    int16_t x, y, z, w; // w pads to 8 bytes
+};
+struct snorm10x3 {
+    uint32_t xyzw; // 2_10_10_10_REV, w is 0
+};
+
+// Position relative to the mesh bounds in [-1, 1], see PositionQuantization
+struct v3t2n3_q16_t {
+    snorm16x3 position;
+    half2 uv;
+    snorm10x3 normal;
+};
+struct v3uv2n3t3_q16_t {
+    snorm16x3 position;
+    half2 uv;
+    snorm10x3 normal;
+    snorm10x3 tangent;
+};
+
+// Component type of an attribute member, specialize for new member types
+template <typename T>
+struct vertex_component;
+
+template <>
+struct vertex_component<float> {
+    static constexpr int32_t count = 1;
+    static constexpr GLenum type = GL_FLOAT;
+    static constexpr bool normalized = false;
+};
+
+template <>
+struct vertex_component<vec2> : vertex_component<float> {
+    static constexpr int32_t count = 2;
+};
+
+template <>
+struct vertex_component<vec3> : vertex_component<float> {
+    static constexpr int32_t count = 3;
+};
+
+template <>
+struct vertex_component<vec4> : vertex_component<float> {
+    static constexpr int32_t count = 4;
+};
+
+template <>
+struct vertex_component<half2> {
+    static constexpr int32_t count = 2;
+    static constexpr GLenum type = GL_HALF_FLOAT;
+    static constexpr bool normalized = false;
+};
+
+template <>
+struct vertex_component<snorm16x3> {
+    static constexpr int32_t count = 3;
+    static constexpr GLenum type = GL_SHORT;
+    static constexpr bool normalized = true;
+};
+
+template <>
+struct vertex_component<snorm10x3> {
+    static constexpr int32_t count = 4;
+    static constexpr GLenum type = GL_INT_2_10_10_10_REV;
+    static constexpr bool normalized = true;
+};
+
+constexpr uint32_t MAX_VERTEX_ATTRIBUTES = 8;
+
+struct VertexAttribute {
+    uint32_t location = 0;
+    int32_t components = 0;
+    GLenum type = GL_FLOAT;
+    bool normalized = false;
+    uint32_t offset = 0;
+    uint32_t size = 0;
+};
+
+template <typename A>
+constexpr auto make_vertex_attribute( uint32_t location, size_t offset ) -> VertexAttribute {
+    using C = vertex_component<A>;
+    return { location, C::count, C::type, C::normalized, static_cast<uint32_t>( offset ), sizeof( A ) };
+}
+
+#define GRAPHICS_VERTEX_ATTRIBUTE( vertex, member, location ) \
+    graphics::make_vertex_attribute<decltype( vertex::member )>( location, offsetof( vertex, member ) )
+
+// Attribute list of a vertex struct, specialize with a static constexpr std::array of VertexAttribute
+template <typename T>
+struct vertex_traits;
+
+template <>
+struct vertex_traits<v3_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3_t, position, 0 ) };
+};
+
+template <>
+struct vertex_traits<v3n3_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3n3_t, position, 0 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3n3_t, normal, 2 ) };
+};
+
+template <>
+struct vertex_traits<v3t2_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3t2_t, position, 0 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3t2_t, uv, 1 ) };
+};
+
+template <>
+struct vertex_traits<v3t2n3_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3t2n3_t, position, 0 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3t2n3_t, uv, 1 ), GRAPHICS_VERTEX_ATTRIBUTE( v3t2n3_t, normal, 2 ) };
+};
+
+template <>
+struct vertex_traits<v3uv2n3t3_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_t, position, 0 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_t, uv, 1 ), GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_t, normal, 2 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_t, tangent, 3 ) };
+};
+
+template <>
+struct vertex_traits<v3t2n3_q16_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3t2n3_q16_t, position, 0 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3t2n3_q16_t, uv, 1 ), GRAPHICS_VERTEX_ATTRIBUTE( v3t2n3_q16_t, normal, 2 ) };
+};
+
+template <>
+struct vertex_traits<v3uv2n3t3_q16_t> {
+    static constexpr std::array attributes = { GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_q16_t, position, 0 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_q16_t, uv, 1 ), GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_q16_t, normal, 2 ),
+        GRAPHICS_VERTEX_ATTRIBUTE( v3uv2n3t3_q16_t, tangent, 3 ) };
+};
+
+struct VertexLayout {
+    uint32_t stride = 0;
+    uint32_t num_attributes = 0;
+    std::array<VertexAttribute, MAX_VERTEX_ATTRIBUTES> attributes = { };
+    bool indexed = false;
+};
+
+// Attributes stay inside the vertex, don't overlap and use distinct locations
+template <typename T>
+constexpr auto is_vertex_layout_valid( ) -> bool {
+    constexpr auto& attributes = vertex_traits<T>::attributes;
+    if ( attributes.size( ) == 0 || attributes.size( ) > MAX_VERTEX_ATTRIBUTES )
+        return false;
+
+    for ( size_t i = 0; i < attributes.size( ); i++ ) {
+        const auto& a = attributes[i];
+        if ( a.location >= MAX_VERTEX_ATTRIBUTES || a.offset + a.size > sizeof( T ) )
+            return false;
+
+        for ( size_t j = 0; j < i; j++ ) {
+            const auto& b = attributes[j];
+            if ( a.location == b.location || ( a.offset < b.offset + b.size && b.offset < a.offset + a.size ) )
+                return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename T>
+constexpr auto make_vertex_layout( bool indexed ) -> VertexLayout {
+    static_assert( is_vertex_layout_valid<T>( ), "Invalid vertex_traits attributes" );
+
+    VertexLayout layout { .stride = sizeof( T ), .indexed = indexed };
+    for ( const auto& a : vertex_traits<T>::attributes ) {
+        layout.attributes[layout.num_attributes++] = a;
+    }
+
+    return layout;
+}
+
+// ( name, vertex struct, indexed ), append only since captures store the format value
+#define GRAPHICS_VERTEX_FORMATS( X ) \
+    X( v3_f32, v3_t, false ) \
+    X( v3_f32ui16, v3_t, true ) \
+    X( v3n3_f32ui16, v3n3_t, true ) \
+    X( v3t2_f32ui16, v3t2_t, true ) \
+    X( v3t2n3_f32ui16, v3t2n3_t, true ) \
+    X( v3uv2n3t3_f32ui16, v3uv2n3t3_t, true ) \
+    X( v3t2n3_q16ui16, v3t2n3_q16_t, true ) \
+    X( v3uv2n3t3_q16ui16, v3uv2n3t3_q16_t, true )
+
+enum class VertexFormat : std::uint32_t {
+    unknown,
+#define X( name, vertex, indexed ) name,
+    GRAPHICS_VERTEX_FORMATS( X )
+#undef X
+};
+
 ///
 /// Pipeline states
 ///
@@ -110,6 +320,162 @@ struct DepthStencilState {
     uint32_t depth_func = GL_LESS;
 };
 
+///
+/// State cache
+///
+constexpr uint32_t MAX_CACHED_TEXTURE_UNITS = 32;
+
+struct PresentStats {
+    uint32_t issued_calls = 0;
+    uint32_t saved_calls = 0;
+    uint32_t multi_draws = 0; // glMultiDrawElementsIndirect calls
+    uint32_t coalesced_draws = 0; // Draws folded into them
+};
+
+// Shadow copy of the GL state touched by present( ), every setter emits GL calls only on change
+struct StateCache {
+    static constexpr uint32_t unknown = static_cast<uint32_t>( -1 );
+
+    StateCache( ) {
+        textures.fill( unknown );
+    }
+
+    auto invalidate( ) noexcept -> void {
+        const auto s = stats;
+        *this = StateCache { };
+        stats = s;
+    }
+
+    auto bind_program_pipeline( uint32_t id ) -> void {
+        if ( changed( pipeline, id ) )
+            glBindProgramPipeline( id );
+    }
+
+    auto bind_vertex_array( uint32_t id ) -> void {
+        if ( changed( vao, id ) )
+            glBindVertexArray( id );
+    }
+
+    auto bind_framebuffer( uint32_t id ) -> void {
+        if ( changed( framebuffer, id ) )
+            glBindFramebuffer( GL_FRAMEBUFFER, id );
+    }
+
+    auto bind_indirect_buffer( uint32_t id ) -> void {
+        if ( changed( indirect, id ) )
+            glBindBuffer( GL_DRAW_INDIRECT_BUFFER, id );
+    }
+
+    auto bind_texture_unit( uint32_t unit, uint32_t id ) -> void {
+        if ( unit >= MAX_CACHED_TEXTURE_UNITS ) {
+            stats.issued_calls++;
+            glBindTextureUnit( unit, id );
+        } else if ( changed( textures[unit], id ) ) {
+            glBindTextureUnit( unit, id );
+        }
+    }
+
+    auto set_blend( bool enable, uint32_t sfactor, uint32_t dfactor ) -> void {
+        if ( changed( blend, static_cast<uint32_t>( enable ) ) )
+            enable ? glEnable( GL_BLEND ) : glDisable( GL_BLEND );
+
+        if ( enable && ( changed( blend_sfactor, sfactor ) | changed( blend_dfactor, dfactor ) ) )
+            glBlendFunc( sfactor, dfactor );
+    }
+
+    auto set_cull( bool enable, uint32_t mode ) -> void {
+        if ( changed( cull, static_cast<uint32_t>( enable ) ) )
+            enable ? glEnable( GL_CULL_FACE ) : glDisable( GL_CULL_FACE );
+
+        if ( enable && changed( cull_mode, mode ) )
+            glCullFace( mode );
+    }
+
+    auto set_depth( bool test, uint32_t func, bool write ) -> void {
+        if ( changed( depth_test, static_cast<uint32_t>( test ) ) )
+            test ? glEnable( GL_DEPTH_TEST ) : glDisable( GL_DEPTH_TEST );
+
+        if ( test && changed( depth_func, func ) )
+            glDepthFunc( func );
+
+        if ( changed( depth_mask, static_cast<uint32_t>( write ) ) )
+            glDepthMask( write ? GL_TRUE : GL_FALSE );
+    }
+
+    auto clip_control( uint32_t origin, uint32_t depth ) -> void {
+        if ( changed( clip_origin, origin ) | changed( clip_depth, depth ) )
+            glClipControl( origin, depth );
+    }
+
+    auto set_viewport( const vec4& v ) -> void {
+        if ( changed( viewport, v ) )
+            glViewportIndexedfv( 0, &v[0] );
+    }
+
+    // GL unbinds deleted objects, so the cache must follow
+    auto forget_program_pipeline( uint32_t id ) noexcept -> void {
+        if ( pipeline == id )
+            pipeline = 0;
+    }
+
+    auto forget_vertex_array( uint32_t id ) noexcept -> void {
+        if ( vao == id )
+            vao = 0;
+    }
+
+    auto forget_framebuffer( uint32_t id ) noexcept -> void {
+        if ( framebuffer == id )
+            framebuffer = 0;
+    }
+
+    auto forget_buffer( uint32_t id ) noexcept -> void {
+        if ( indirect == id )
+            indirect = 0;
+    }
+
+    auto forget_texture( uint32_t id ) noexcept -> void {
+        for ( auto& t : textures ) {
+            if ( t == id )
+                t = 0;
+        }
+    }
+
+    uint32_t pipeline = unknown;
+    uint32_t vao = unknown;
+    uint32_t framebuffer = unknown;
+    uint32_t indirect = unknown;
+    std::array<uint32_t, MAX_CACHED_TEXTURE_UNITS> textures;
+
+    uint32_t blend = unknown;
+    uint32_t blend_sfactor = unknown;
+    uint32_t blend_dfactor = unknown;
+    uint32_t cull = unknown;
+    uint32_t cull_mode = unknown;
+    uint32_t depth_test = unknown;
+    uint32_t depth_func = unknown;
+    uint32_t depth_mask = unknown;
+    uint32_t clip_origin = unknown;
+    uint32_t clip_depth = unknown;
+    vec4 viewport = vec4 { -1.f };
+
+    PresentStats stats;
+
+private:
+    template <typename T> auto changed( T& cached, const T& value ) noexcept -> bool {
+        if ( cached == value ) {
+            stats.saved_calls++;
+            return false;
+        }
+
+        cached = value;
+        stats.issued_calls++;
+        return true;
+    }
+};
+
+// Shadows the state of the one context every translation unit presents to
+inline StateCache state_cache;
+
 ///
 /// Graphics objects
 ///
@@ -123,6 +489,8 @@ struct Texture {
     uint32_t width = 0;
     uint32_t height = 0;
     uint32_t depth = 0;
+    PixelFormat format = PixelFormat::unknown;
+    uint32_t levels = 0;
 };
 
 enum class TextureFiltering {
@@ -133,6 +501,43 @@ enum class TextureFiltering {
 };
 
 using u8_buffer = std::vector<uint8_t>;
+using byte_span = std::span<const std::byte>; // Borrowed from a constexpr array, a mapped file or a decoder
+
+// Ordered by width, geometry uses the narrowest type that addresses all of its vertices
+enum class IndexType : std::uint32_t { u8, u16, u32 };
+
+constexpr auto index_size( IndexType type ) noexcept -> uint32_t {
+    return 1u << static_cast<uint32_t>( type );
+}
+
+template <typename T>
+concept index_element = std::same_as<T, uint8_t> || std::same_as<T, uint16_t> || std::same_as<T, uint32_t>;
+
+// Borrowed indices of any width, converted to the index type of the geometry they are uploaded to
+struct IndexSpan {
+    IndexSpan( ) = default;
+
+    IndexSpan( byte_span data, IndexType index_type )
+        : bytes { data }
+        , type { index_type } {
+    }
+
+    template <std::ranges::contiguous_range R>
+        requires index_element<std::ranges::range_value_t<R>>
+    IndexSpan( const R& indices )
+        : bytes { std::as_bytes( std::span { std::ranges::data( indices ), std::ranges::size( indices ) } ) }
+        , type { sizeof( std::ranges::range_value_t<R> ) == 1   ? IndexType::u8
+                 : sizeof( std::ranges::range_value_t<R> ) == 2 ? IndexType::u16
+                                                                : IndexType::u32 } {
+    }
+
+    auto size( ) const noexcept -> size_t {
+        return bytes.size( ) / index_size( type );
+    }
+
+    byte_span bytes;
+    IndexType type = IndexType::u16;
+};
 
 struct CreateTextureInfo {
     uint32_t width = 0;
@@ -142,7 +547,7 @@ struct CreateTextureInfo {
     bool mipmaps = true;
     uint32_t levels = 4;
     TextureFiltering filter = TextureFiltering::Trilinear;
-    u8_buffer pixels;
+    u8_buffer pixels = { };
 };
 
 struct CreateTextureArrayInfo {
@@ -153,7 +558,7 @@ struct CreateTextureArrayInfo {
     bool mipmaps = true;
     uint32_t levels = 4;
     TextureFiltering filter = TextureFiltering::Trilinear;
-    std::vector<u8_buffer> pixels;
+    std::vector<u8_buffer> pixels = { };
 };
 
 using CreateTextureCubemapInfo = CreateTextureArrayInfo;
@@ -167,7 +572,18 @@ struct TextureSampler {
     uint32_t target = 0;
 };
 
-enum class BufferType { Unknown, VertexArray, VertexElements, Uniform };
+enum class BufferType { Unknown, VertexArray, VertexElements, Uniform, Indirect, Storage };
+
+enum class BufferUsage {
+    Static, // Written once
+    Dynamic, // Rewritten now and then
+    Stream, // Rewritten every frame
+};
+
+struct BufferRange {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+};
 
 struct Buffer {
     auto is_valid( ) const noexcept -> bool {
@@ -176,11 +592,90 @@ struct Buffer {
 
     uint32_t id = 0;
     uint32_t size = 0;
+    std::vector<BufferRange> dirty = { }; // Sorted by offset, overlapping and touching ranges are merged
+    BufferUsage usage = BufferUsage::Dynamic;
 };
 
 struct CreateBufferInfo {
     void* data = nullptr;
     size_t size = 0;
+    BufferUsage usage = BufferUsage::Dynamic;
+};
+
+constexpr uint32_t MAX_RING_FRAMES = 4;
+
+// Persistently mapped buffer split into one segment per frame in flight, a segment is reused once its fence signals
+struct RingBuffer {
+    auto is_valid( ) const noexcept -> bool {
+        return id != 0;
+    }
+
+    uint32_t id = 0;
+    uint32_t segment_size = 0;
+    uint32_t num_frames = 0;
+    uint32_t alignment = 0;
+    uint32_t frame = 0; // Segment written this frame
+    uint32_t head = 0; // Next free offset inside the segment
+    std::byte* mapped = nullptr;
+    std::array<GLsync, MAX_RING_FRAMES> fences = { };
+};
+
+struct CreateRingBufferInfo {
+    size_t size = 0; // Bytes per frame
+    uint32_t frames_in_flight = 3;
+};
+
+// Range of a ring buffer segment, valid until the end of the frame it was allocated in
+struct RingAllocation {
+    auto is_valid( ) const noexcept -> bool {
+        return data != nullptr;
+    }
+
+    uint32_t id = 0;
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    void* data = nullptr;
+};
+
+using UploadTicket = uint64_t;
+
+// Copy into a buffer range or one texture layer, the bytes are owned by the queue until they are staged
+struct PendingUpload {
+    UploadTicket ticket = 0;
+    uint32_t id = 0;
+    uint32_t target = 0; // Texture target, 0 for buffers
+    size_t offset = 0; // Buffer offset or texture layer
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t format = 0;
+    uint32_t type = 0;
+    bool mipmaps = false; // Generated after this layer, set on the last layer of a texture
+    std::vector<std::byte> data;
+    size_t staged = 0; // Buffer uploads larger than the budget are split across frames
+};
+
+struct UploadFence {
+    GLsync fence = nullptr;
+    UploadTicket ticket = 0; // Last upload fully staged before the fence
+};
+
+// Uploads gathered into a persistently mapped staging ring, one segment of frame_budget bytes is copied per flush
+struct UploadQueue {
+    auto is_valid( ) const noexcept -> bool {
+        return staging.is_valid( );
+    }
+
+    RingBuffer staging;
+    std::deque<PendingUpload> pending;
+    std::deque<UploadFence> in_flight;
+    UploadTicket last_ticket = 0; // Ticket of the most recent upload
+    UploadTicket completed = 0;
+    size_t pending_bytes = 0;
+};
+
+struct CreateUploadQueueInfo {
+    size_t frame_budget = 8 << 20; // Bytes copied per flush
+    uint32_t frames_in_flight = 2;
 };
 
 struct Renderbuffer {
@@ -254,6 +749,26 @@ struct CreateShaderInfo {
     std::string source;
 };
 
+constexpr uint32_t MAX_GEOMETRY_LODS = 8;
+
+// Index range of one level of detail, error is the largest simplification distance in vertex units
+struct GeometryLod {
+    uint32_t first_index = 0;
+    uint32_t num_elements = 0;
+    float error = 0.f;
+};
+
+// Maps quantized positions back to the mesh bounds. The scale is per axis, so position_matrix( ) goes between the
+// positions and the model matrix and stays out of the normal transform, normals and tangents are stored unscaled
+struct PositionQuantization {
+    vec3 offset = vec3 { 0.0f };
+    vec3 scale = vec3 { 1.0f };
+
+    auto position_matrix( ) const -> mat4 {
+        return glm::scale( glm::translate( mat4 { 1.0f }, offset ), scale );
+    }
+};
+
 struct Geometry {
     auto is_valid( ) const noexcept -> bool {
         return vao != 0;
@@ -264,7 +779,20 @@ struct Geometry {
     uint32_t vao = 0; // Vertex array object
 
     VertexFormat format = VertexFormat::unknown;
+    IndexType index_type = IndexType::u16;
     uint32_t num_elements = 0;
+
+    // Ranges inside the buffers, only pooled geometry shares them with other meshes
+    uint32_t base_vertex = 0;
+    uint32_t first_index = 0;
+    uint32_t num_vertices = 0;
+    bool pooled = false;
+
+    // Coarser levels follow the full mesh in the same index buffer, see select_lod
+    std::array<GeometryLod, MAX_GEOMETRY_LODS> lods = { };
+    uint32_t num_lods = 0;
+
+    PositionQuantization quantization; // Identity unless the geometry was created with quantize
 };
 
 struct CreateGeometryInfo {
@@ -273,8 +801,118 @@ struct CreateGeometryInfo {
     vec3 min = vec3 { 0.f };
     vec3 max = vec3 { 0.f };
     VertexFormat format = VertexFormat::unknown;
-    u8_buffer vertices;
-    std::vector<uint16_t> indices = { };
+    u8_buffer vertices = { };
+    std::vector<uint32_t> indices = { }; // Stored at the narrowest type that fits vertices_num
+    bool optimize = false; // Reorders a copy of the mesh with optimize_mesh before uploading it
+    uint32_t lods = 1; // Levels of detail built with build_lod_chain, 1 keeps only the full mesh
+    bool quantize = false; // Uploads v3t2n3 and v3uv2n3t3 meshes at their _q16 format, see Geometry::quantization
+};
+
+struct GeometryRange {
+    uint32_t offset = 0;
+    uint32_t count = 0;
+};
+
+// Shared vertex and element buffers of one format, meshes are suballocated ranges drawn with the same VAO
+struct GeometryPool {
+    auto is_valid( ) const noexcept -> bool {
+        return vao != 0;
+    }
+
+    uint32_t vb = 0;
+    uint32_t eb = 0;
+    uint32_t vao = 0;
+
+    VertexFormat format = VertexFormat::unknown;
+    IndexType index_type = IndexType::u16;
+    uint32_t vertex_capacity = 0;
+    uint32_t index_capacity = 0;
+    uint32_t num_geometries = 0;
+
+    std::vector<GeometryRange> free_vertices; // Sorted by offset, neighbours merged
+    std::vector<GeometryRange> free_indices;
+};
+
+struct CreateGeometryPoolInfo {
+    VertexFormat format = VertexFormat::unknown;
+    uint32_t vertex_capacity = 1 << 20;
+    uint32_t index_capacity = 3 << 20;
+    IndexType index_type = IndexType::u16; // Shared by all meshes, indices are relative to their base vertex
+};
+
+// Objects destroyed during one frame, released once the fence of that frame signals
+struct RetiredFrame {
+    auto empty( ) const noexcept -> bool {
+        return buffers.empty( ) && textures.empty( ) && geometries.empty( );
+    }
+
+    GLsync fence = nullptr;
+    uint64_t frame = 0;
+    std::vector<Buffer> buffers;
+    std::vector<Texture> textures;
+    std::vector<Geometry> geometries;
+};
+
+// Keeps destroyed objects alive until the GPU finished the frames that may use them, retired buffers and textures
+// are recycled by later creations of the same size instead of being deleted
+struct DeletionQueue {
+    RetiredFrame current; // Collects the objects destroyed this frame
+    std::deque<RetiredFrame> frames; // Fenced, oldest first
+    std::unordered_map<uint64_t, std::vector<Buffer>> free_buffers; // Keyed by size and usage, see free_buffer_key
+    std::vector<Texture> free_textures;
+    uint64_t frame = 0;
+    uint32_t frames_in_flight = 2;
+    uint32_t max_recycled = 32;
+    uint32_t recycled = 0; // Creations served from the free lists
+};
+
+struct CreateDeletionQueueInfo {
+    uint32_t frames_in_flight = 2; // Frames an object is kept at least, on top of its fence
+    uint32_t max_recycled = 32; // Free buffers kept per size and usage, and free textures, 0 deletes them all
+};
+
+struct TransientBufferStats {
+    auto hit_rate( ) const noexcept -> float {
+        return requests > 0 ? static_cast<float>( hits ) / static_cast<float>( requests ) : 0.f;
+    }
+
+    uint64_t requests = 0;
+    uint64_t hits = 0; // Requests served by a recycled buffer
+};
+
+// Short lived buffers rounded up to power of two size classes, released buffers return through a deletion queue
+// and are handed out again once the GPU is done with them
+struct TransientBufferPool {
+    DeletionQueue retired;
+    TransientBufferStats stats;
+};
+
+struct CreateTransientBufferPoolInfo {
+    uint32_t frames_in_flight = 2;
+    uint32_t max_free = 16; // Free buffers kept per size class and usage
+};
+
+constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 8;
+
+struct FrameLimiterStats {
+    uint64_t frames = 0;
+    uint64_t stalls = 0; // Frames that had to wait for the GPU
+    std::chrono::nanoseconds last_wait { 0 };
+    std::chrono::nanoseconds total_wait { 0 };
+    std::chrono::nanoseconds worst_wait { 0 };
+};
+
+// Bounds how many frames the GPU may lag behind the CPU with one fence per frame, fewer frames trade throughput
+// for input latency
+struct FrameLimiter {
+    std::array<GLsync, MAX_FRAMES_IN_FLIGHT> fences = { };
+    uint32_t max_frames = 2;
+    uint32_t frame = 0;
+    FrameLimiterStats stats;
+};
+
+struct CreateFrameLimiterInfo {
+    uint32_t max_frames = 2;
 };
 
 struct ProgramResourceInfo {
@@ -286,6 +924,11 @@ struct ProgramResourceInfo {
     uint32_t buffer_binding = 0;
 };
 
+struct UniformLookup {
+    uint32_t hash = 0;
+    uint32_t index = 0; // Index in ProgramPipeline::uniforms
+};
+
 struct ProgramPipeline {
     auto is_valid( ) const noexcept -> bool {
         return id != 0;
@@ -296,58 +939,303 @@ struct ProgramPipeline {
     std::vector<ProgramResourceInfo> uniforms;
     std::vector<ProgramResourceInfo> attributes;
     std::vector<ProgramResourceInfo> uniform_blocks;
+    std::vector<UniformLookup> uniform_lookup; // Sorted by hash
 };
 
-struct CreatePipelineInfo {
-    std::vector<Shader> shaders;
-};
-
-[[maybe_unused]] static Framebuffer default_framebuffer { .id = 0, .mask = GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT };
-
 ///
-/// Commands
+/// Memory accounting
 ///
-struct ClearCommand {
-    ClearCommand( ) = default;
+enum class MemoryCategory : uint32_t { texture, renderbuffer, buffer, geometry };
 
-    ClearCommand( const vec4& clear_color )
-        : color { clear_color }
-        , viewport { 0.f, 0.f, default_framebuffer.width, default_framebuffer.height }
-        , depth { 1.f }
-        , fb { default_framebuffer.id } {
+constexpr size_t MEMORY_CATEGORIES = 4;
+
+struct MemoryUsage {
+    auto add( size_t size ) noexcept -> void {
+        bytes += size;
+        peak = std::max( peak, bytes );
+        allocations++;
     }
 
-    ClearCommand( const Framebuffer& f, const vec4& clear_color )
-        : color { clear_color }
-        , viewport { 0.f, 0.f, f.width, f.height }
-        , depth { 1.f }
-        , fb { f.id } {
+    auto remove( size_t size ) noexcept -> void {
+        bytes -= size;
+        allocations--;
     }
 
-    vec4 color = { 0.0f, 0.0f, 0.0f, 1.f };
-    vec4 viewport = { };
-    float depth = 1.0f;
-    uint32_t fb = 0;
+    size_t bytes = 0;
+    size_t peak = 0; // High-water mark of bytes
+    uint32_t allocations = 0;
 };
 
-struct BindBufferCommand {
-    BindBufferCommand( ) = default;
-    BindBufferCommand( BufferType t, const Buffer& b )
-        : type { t }
-        , id { b.id } {
-    }
-
+struct MemoryTagUsage {
+    std::string name;
+    MemoryUsage usage;
+};
+
+struct MemoryStats {
+    MemoryUsage total;
+    std::array<MemoryUsage, MEMORY_CATEGORIES> categories = { };
+    std::vector<MemoryTagUsage> tags = { { "untagged", { } } };
+};
+
+struct MemoryBudget {
+    size_t limit = 0; // Bytes, 0 is unlimited
+    bool refuse = false; // Allocations over the limit fail instead of only warning
+};
+
+namespace detail {
+
+    struct MemoryAllocation {
+        MemoryCategory category = MemoryCategory::texture;
+        uint32_t tag = 0;
+        size_t size = 0;
+    };
+
+    // Sizes are computed from the creation info, drivers may pad or compress the real storage
+    struct MemoryTracker {
+        auto reserve( MemoryCategory category, size_t size ) -> bool {
+            if ( budget.limit == 0 || stats.total.bytes + size <= budget.limit )
+                return true;
+
+            journal::warning( GRAPHICS_TAG, "{} bytes of {} exceed the memory budget, {} of {} bytes in use", size,
+                category_name( category ), stats.total.bytes, budget.limit );
+            return !budget.refuse;
+        }
+
+        auto track( MemoryCategory category, uint32_t id, size_t size ) -> void {
+            live[key( category, id )] = { category, tag, size };
+            stats.total.add( size );
+            stats.categories[static_cast<size_t>( category )].add( size );
+            stats.tags[tag].usage.add( size );
+        }
+
+        auto release( MemoryCategory category, uint32_t id ) -> void {
+            const auto it = live.find( key( category, id ) );
+            if ( it == live.end( ) )
+                return;
+
+            const auto& a = it->second;
+            stats.total.remove( a.size );
+            stats.categories[static_cast<size_t>( a.category )].remove( a.size );
+            stats.tags[a.tag].usage.remove( a.size );
+            live.erase( it );
+        }
+
+        static constexpr auto key( MemoryCategory category, uint32_t id ) noexcept -> uint64_t {
+            return ( static_cast<uint64_t>( category ) << 32 ) | id;
+        }
+
+        static constexpr auto category_name( MemoryCategory category ) noexcept -> std::string_view {
+            constexpr std::array<std::string_view, MEMORY_CATEGORIES> names
+                = { "texture", "renderbuffer", "buffer", "geometry" };
+            return names[static_cast<size_t>( category )];
+        }
+
+        MemoryBudget budget;
+        uint32_t tag = 0; // Index in stats.tags charged for new allocations
+        MemoryStats stats;
+        std::unordered_map<uint64_t, MemoryAllocation> live;
+    };
+
+    inline MemoryTracker memory_tracker;
+
+    // Tightly packed bytes per pixel
+    inline auto pixel_size( PixelFormat format ) noexcept -> size_t {
+        switch ( format ) {
+        case PixelFormat::unknown:
+            break;
+        case PixelFormat::r8:
+            return 1;
+        case PixelFormat::rg8:
+        case PixelFormat::r16f:
+            return 2;
+        case PixelFormat::rgb8:
+        case PixelFormat::bgr8:
+            return 3;
+        case PixelFormat::rgba8:
+        case PixelFormat::bgra8:
+        case PixelFormat::r32f:
+        case PixelFormat::depth:
+            return 4;
+        case PixelFormat::rgb16f:
+            return 6;
+        case PixelFormat::rgba16f:
+            return 8;
+        case PixelFormat::rgb32f:
+            return 12;
+        case PixelFormat::rgba32f:
+            return 16;
+        }
+
+        return 0;
+    }
+
+    inline auto texture_size(
+        PixelFormat format, uint32_t width, uint32_t height, uint32_t layers, uint32_t levels ) noexcept -> size_t {
+        size_t size = 0;
+        for ( uint32_t level = 0; level < std::max( levels, 1u ); level++ ) {
+            size += size_t { std::max( width >> level, 1u ) } * std::max( height >> level, 1u );
+        }
+        return size * layers * pixel_size( format );
+    }
+
+} // namespace detail
+
+inline auto memory_stats( ) noexcept -> const MemoryStats& {
+    return detail::memory_tracker.stats;
+}
+
+inline auto memory_usage( MemoryCategory category ) noexcept -> const MemoryUsage& {
+    return detail::memory_tracker.stats.categories[static_cast<size_t>( category )];
+}
+
+inline auto set_memory_budget( const MemoryBudget& budget ) noexcept -> void {
+    detail::memory_tracker.budget = budget;
+}
+
+// Resources created from now on are charged to the tag, an empty name goes back to untagged
+inline auto set_memory_tag( std::string_view name ) -> void {
+    auto& tags = detail::memory_tracker.stats.tags;
+    const auto it = std::find_if(
+        tags.begin( ) + 1, tags.end( ), [&]( const MemoryTagUsage& t ) { return t.name == name; } );
+
+    if ( name.empty( ) ) {
+        detail::memory_tracker.tag = 0;
+    } else if ( it != tags.end( ) ) {
+        detail::memory_tracker.tag = static_cast<uint32_t>( it - tags.begin( ) );
+    } else {
+        detail::memory_tracker.tag = static_cast<uint32_t>( tags.size( ) );
+        tags.push_back( { std::string { name }, { } } );
+    }
+}
+
+///
+/// Uniforms
+///
+constexpr auto hash_name( std::string_view name ) noexcept -> uint32_t {
+    uint32_t hash = 2166136261u;
+    for ( const auto c : name ) {
+        hash = ( hash ^ static_cast<uint8_t>( c ) ) * 16777619u;
+    }
+    return hash;
+}
+
+struct UniformName {
+    uint32_t hash = 0;
+};
+
+// Name hashed at compile time, collisions are reported by create_program_pipeline
+consteval auto uniform_name( std::string_view name ) noexcept -> UniformName {
+    return { hash_name( name ) };
+}
+
+struct UniformHandle {
+    auto is_valid( ) const noexcept -> bool {
+        return pid != 0;
+    }
+
+    uint32_t pid = 0;
+    int32_t location = -1;
+    uint32_t count = 0;
+};
+
+inline auto find_uniform( const ProgramPipeline& p, uint32_t hash ) noexcept -> const ProgramResourceInfo* {
+    const auto it = std::lower_bound( p.uniform_lookup.begin( ), p.uniform_lookup.end( ), hash,
+        []( const UniformLookup& l, uint32_t h ) { return l.hash < h; } );
+    if ( it == p.uniform_lookup.end( ) || it->hash != hash )
+        return nullptr;
+
+    return &p.uniforms[it->index];
+}
+
+inline auto get_uniform( const ProgramPipeline& p, UniformName name ) noexcept -> UniformHandle {
+    if ( const auto u = find_uniform( p, name.hash ); u ) {
+        return { u->pid, u->location, static_cast<uint32_t>( u->num ) };
+    }
+
+    return { };
+}
+
+// Compares names over every entry sharing the hash, so colliding uniforms are still found
+inline auto get_uniform( const ProgramPipeline& p, std::string_view name ) noexcept -> UniformHandle {
+    const auto hash = hash_name( name );
+    const auto [first, last] = std::equal_range( p.uniform_lookup.begin( ), p.uniform_lookup.end( ),
+        UniformLookup { hash, 0 }, []( const UniformLookup& a, const UniformLookup& b ) { return a.hash < b.hash; } );
+    for ( auto it = first; it != last; ++it ) {
+        if ( const auto& u = p.uniforms[it->index]; u.name == name ) {
+            return { u.pid, u.location, static_cast<uint32_t>( u.num ) };
+        }
+    }
+
+    return { };
+}
+
+struct CreatePipelineInfo {
+    std::vector<Shader> shaders;
+};
+
+[[maybe_unused]] static Framebuffer default_framebuffer { .id = 0, .mask = GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT };
+
+///
+/// Commands
+///
+struct ClearCommand {
+    ClearCommand( ) = default;
+
+    ClearCommand( const vec4& clear_color )
+        : color { clear_color }
+        , viewport { 0.f, 0.f, default_framebuffer.width, default_framebuffer.height }
+        , depth { 1.f }
+        , fb { default_framebuffer.id } {
+    }
+
+    ClearCommand( const Framebuffer& f, const vec4& clear_color )
+        : color { clear_color }
+        , viewport { 0.f, 0.f, f.width, f.height }
+        , depth { 1.f }
+        , fb { f.id } {
+    }
+
+    vec4 color = { 0.0f, 0.0f, 0.0f, 1.f };
+    vec4 viewport = { };
+    float depth = 1.0f;
+    uint32_t fb = 0;
+};
+
+struct BindBufferCommand {
+    BindBufferCommand( ) = default;
+    BindBufferCommand( BufferType t, const Buffer& b )
+        : type { t }
+        , id { b.id } {
+    }
+
     BindBufferCommand( BufferType t, const Buffer& b, const ProgramPipeline& p, std::string_view block_name )
         : type { t }
+        , block_index { find_block( p, block_name ) }
         , id { b.id }
         , offset { 0 }
         , size { b.size } {
+    }
+
+    BindBufferCommand( BufferType t, const RingAllocation& a, const ProgramPipeline& p, std::string_view block_name )
+        : BindBufferCommand { t, a, find_block( p, block_name ) } {
+    }
+
+    // Binds to an explicit layout( binding = N ) point, used for storage blocks
+    BindBufferCommand( BufferType t, const RingAllocation& a, int32_t binding )
+        : type { t }
+        , block_index { binding }
+        , id { a.id }
+        , offset { a.offset }
+        , size { a.size } {
+    }
+
+    static auto find_block( const ProgramPipeline& p, std::string_view block_name ) noexcept -> int32_t {
         for ( const auto& ub : p.uniform_blocks ) {
             if ( ub.name == block_name ) {
-                block_index = ub.buffer_binding;
-                break;
+                return static_cast<int32_t>( ub.buffer_binding );
             }
         }
+        return -1;
     }
 
     BufferType type = BufferType::Unknown;
@@ -426,36 +1314,292 @@ struct BlitFramebufferCommand {
 using UniformValue = std::variant<int, float, vec2, vec3, vec4, mat4>;
 
 struct SetUniformCommand {
-    template <typename T> SetUniformCommand( const ProgramPipeline& p, const std::string_view name, const T& v ) {
-        for ( const auto& u : p.uniforms ) {
-            if ( u.name == name ) {
-                location = u.location;
-                count = u.num;
-                value = v;
-                pid = u.pid;
-                _name = name;
-                break;
-            }
-        }
+    template <typename T>
+    SetUniformCommand( const UniformHandle& u, const T& v )
+        : pid { u.pid }
+        , location { u.location }
+        , count { u.count }
+        , value { v } {
+    }
+
+    template <typename T>
+    SetUniformCommand( const ProgramPipeline& p, UniformName name, const T& v )
+        : SetUniformCommand { get_uniform( p, name ), v } {
+    }
+
+    template <typename T>
+    SetUniformCommand( const ProgramPipeline& p, const std::string_view name, const T& v )
+        : SetUniformCommand { get_uniform( p, name ), v } {
     }
 
     uint32_t pid = 0;
     int32_t location = -1;
     uint32_t count = 0;
     UniformValue value;
-    std::string _name;
+};
+
+// How sorted command buffers order draws of equal state by depth, blended draws want back_to_front
+enum class DepthOrder : uint32_t {
+    front_to_back,
+    back_to_front
 };
 
 struct DrawElementsCommand {
     VertexFormat format = VertexFormat::unknown;
+    IndexType index_type = IndexType::u16;
     uint32_t mode = GL_TRIANGLES;
-    uint32_t base_element = 0;
+    uint32_t base_element = 0; // Base vertex, or first vertex for non indexed formats
+    uint32_t first_index = 0;
     uint32_t num_elements = 0;
     uint32_t num_instances = 1;
+    uint32_t base_instance = 0; // Index into per-draw data, gl_BaseInstance in shaders
+    float depth = 0.f; // Normalized view depth, used only by sorted command buffers
+    DepthOrder depth_order = DepthOrder::front_to_back;
 };
 
+// Draws recorded before a barrier are never sorted past it
+struct SequenceBarrierCommand { };
+
 using Command = std::variant<ClearCommand, BindBufferCommand, BindProgramCommand, BindVertexArrayCommand,
-    BindTextureCommand, BindFramebufferCommand, BlitFramebufferCommand, SetUniformCommand, DrawElementsCommand>;
+    BindTextureCommand, BindFramebufferCommand, BlitFramebufferCommand, SetUniformCommand, DrawElementsCommand,
+    SequenceBarrierCommand>;
+
+template <typename T, typename V> struct variant_index;
+
+template <typename T, typename... Ts> struct variant_index<T, std::variant<Ts...>> {
+    static constexpr size_t value = [] {
+        size_t i = 0;
+        ( ( std::is_same_v<T, Ts> ? false : ( ++i, true ) ) && ... );
+        return i;
+    }( );
+};
+
+template <typename T, typename V> constexpr size_t variant_index_v = variant_index<T, V>::value;
+
+///
+/// Command stream
+///
+
+// Inline form of SetUniformCommand inside a command stream, the value bytes follow the record
+struct UniformRecord {
+    auto data( ) const noexcept -> const void* {
+        return this + 1;
+    }
+
+    uint32_t pid = 0;
+    int32_t location = -1;
+    uint32_t count = 0;
+    uint32_t kind = 0; // Index of the value type in UniformValue
+};
+
+struct CommandHeader {
+    uint16_t type = 0; // Index of the command type in Command
+    uint16_t size = 0; // Record size including the header
+};
+
+struct CommandRecord {
+    template <typename T> auto is( ) const noexcept -> bool {
+        return type == variant_index_v<T, Command>;
+    }
+
+    template <typename T> auto as( ) const noexcept -> const T& {
+        return *reinterpret_cast<const T*>( payload );
+    }
+
+    template <typename T> auto get_if( ) const noexcept -> const T* {
+        return is<T>( ) ? &as<T>( ) : nullptr;
+    }
+
+    uint32_t type = 0;
+    uint32_t offset = 0;
+    const std::byte* payload = nullptr;
+};
+
+// Commands packed as tagged POD records into an arena that keeps its capacity between frames
+class CommandStream {
+public:
+    static constexpr size_t alignment = 4;
+
+    class iterator {
+    public:
+        iterator( const std::byte* base, uint32_t offset )
+            : _base { base }
+            , _offset { offset } {
+        }
+
+        auto operator*( ) const noexcept -> CommandRecord {
+            return record( _base, _offset );
+        }
+
+        auto operator++( ) noexcept -> iterator& {
+            _offset += reinterpret_cast<const CommandHeader*>( _base + _offset )->size;
+            return *this;
+        }
+
+        auto operator==( const iterator& other ) const noexcept -> bool {
+            return _offset == other._offset;
+        }
+
+    private:
+        const std::byte* _base = nullptr;
+        uint32_t _offset = 0;
+    };
+
+    auto push( const Command& command ) -> void {
+        const auto type = static_cast<uint16_t>( command.index( ) );
+
+        std::visit(
+            [&]( auto&& arg ) {
+                using T = std::decay_t<decltype( arg )>;
+                if constexpr ( std::is_same_v<T, SetUniformCommand> ) {
+                    std::visit(
+                        [&]( auto&& value ) {
+                            const UniformRecord u { arg.pid, arg.location, arg.count,
+                                static_cast<uint32_t>( arg.value.index( ) ) };
+                            write( type, &u, sizeof u, &value, sizeof value );
+                        },
+                        arg.value );
+                } else {
+                    static_assert( std::is_trivially_copyable_v<T> && alignof( T ) <= alignment );
+                    write( type, &arg, sizeof arg, nullptr, 0 );
+                }
+            },
+            command );
+    }
+
+    // Records are position independent, so another stream is appended as a single copy
+    auto append( const CommandStream& other ) -> void {
+        if ( other._size == 0 )
+            return;
+
+        reserve( _size + other._size );
+        memcpy( _data.data( ) + _size, other._data.data( ), other._size );
+        _size += other._size;
+        _count += other._count;
+    }
+
+    auto reserve( size_t bytes ) -> void {
+        if ( bytes > _data.size( ) ) {
+            _data.resize( std::max( { _data.size( ) * 2, bytes, size_t { 4096 } } ) );
+        }
+    }
+
+    auto clear( ) noexcept -> void {
+        _size = 0;
+        _count = 0;
+    }
+
+    auto at( uint32_t offset ) const noexcept -> CommandRecord {
+        return record( _data.data( ), offset );
+    }
+
+    // Replaces the contents with already encoded records, the caller validates them
+    auto assign( const std::byte* data, size_t bytes, uint32_t count ) -> void {
+        clear( );
+        reserve( bytes );
+        memcpy( _data.data( ), data, bytes );
+        _size = bytes;
+        _count = count;
+    }
+
+    auto data( ) const noexcept -> const std::byte* {
+        return _data.data( );
+    }
+
+    // Overwrites payload bytes of an already recorded command
+    auto patch( uint32_t offset, const void* data, size_t size ) noexcept -> void {
+        memcpy( _data.data( ) + offset, data, size );
+    }
+
+    auto begin( ) const noexcept -> iterator {
+        return { _data.data( ), 0 };
+    }
+
+    auto end( ) const noexcept -> iterator {
+        return { _data.data( ), static_cast<uint32_t>( _size ) };
+    }
+
+    auto size( ) const noexcept -> size_t {
+        return _count;
+    }
+
+    auto empty( ) const noexcept -> bool {
+        return _count == 0;
+    }
+
+    auto size_bytes( ) const noexcept -> size_t {
+        return _size;
+    }
+
+    auto capacity_bytes( ) const noexcept -> size_t {
+        return _data.size( );
+    }
+
+private:
+    static auto record( const std::byte* base, uint32_t offset ) noexcept -> CommandRecord {
+        const auto header = reinterpret_cast<const CommandHeader*>( base + offset );
+        return { header->type, offset, base + offset + sizeof( CommandHeader ) };
+    }
+
+    auto write( uint16_t type, const void* a, size_t a_size, const void* b, size_t b_size ) -> void {
+        const auto size = ( sizeof( CommandHeader ) + a_size + b_size + alignment - 1 ) & ~( alignment - 1 );
+
+        reserve( _size + size );
+
+        auto ptr = _data.data( ) + _size;
+        const CommandHeader header { type, static_cast<uint16_t>( size ) };
+        memcpy( ptr, &header, sizeof header );
+        memcpy( ptr + sizeof header, a, a_size );
+        if ( b_size > 0 ) {
+            memcpy( ptr + sizeof header + a_size, b, b_size );
+        }
+
+        _size += size;
+        _count++;
+    }
+
+    std::vector<std::byte> _data;
+    size_t _size = 0;
+    uint32_t _count = 0;
+};
+
+///
+/// Draw sorting
+///
+struct SortItem {
+    uint64_t key = 0;
+    uint32_t packet = 0;
+};
+
+struct DrawPacket {
+    uint32_t draw = 0; // Stream offset of the draw command
+    uint32_t first_state = 0; // Range in SortState::states
+    uint32_t num_states = 0;
+};
+
+struct StateSlot {
+    uint64_t slot = 0;
+    uint32_t command = 0;
+};
+
+// Scratch storage reused between frames by sorted command buffers
+struct SortState {
+    auto clear( ) noexcept {
+        packets.clear( );
+        states.clear( );
+        items.clear( );
+    }
+
+    std::vector<DrawPacket> packets;
+    std::vector<uint32_t> states;
+    std::vector<SortItem> items;
+    std::vector<SortItem> scratch;
+    std::vector<StateSlot> live;
+    std::vector<StateSlot> issued;
+    std::unordered_map<uint32_t, uint32_t> pipelines; // Object ids to dense per-frame sort key indices
+    std::unordered_map<uint32_t, uint32_t> textures;
+    std::unordered_map<uint32_t, uint32_t> vaos;
+};
 
 struct CommandBuffer {
     CommandBuffer( ) = default;
@@ -467,11 +1611,11 @@ struct CommandBuffer {
     auto operator=( CommandBuffer&& a ) -> CommandBuffer& = default;
 
     template <typename... Args> auto emplace( Args&&... args ) {
-        commands.emplace( std::forward<Args>( args )... );
+        commands.push( Command { std::forward<Args>( args )... } );
     }
 
     auto push( const Command& command ) {
-        commands.push_back( command );
+        commands.push( command );
     }
 
     auto clear( ) noexcept {
@@ -479,12 +1623,15 @@ struct CommandBuffer {
     }
 
     bool presentation_clear = true;
+    bool sorted = false; // Reorder draws by state between barriers to minimize state changes
+    bool coalesce_draws = false; // Fold runs of indexed draws without state changes into one multi draw
 
     ColorBlendState color_blend;
     RasterizerState rasterizer;
     DepthStencilState depth_stencil;
 
-    std::vector<Command> commands;
+    CommandStream commands;
+    SortState sort_state;
 };
 
 using CommandQueue = CommandBuffer;
@@ -495,73 +1642,236 @@ inline auto operator<<( CommandQueue& cb, const Command& c ) -> CommandQueue& {
     return cb;
 }
 
-namespace detail {
-
-    inline auto set_color_blend_state( const ColorBlendState& state ) -> void {
-        if ( state.enable ) {
-            glEnable( GL_BLEND );
-            glBlendFunc( state.sfactor, state.dfactor );
-        }
+///
+/// Command bundles
+///
+struct BundleParameter {
+    auto is_valid( ) const noexcept -> bool {
+        return offset != 0;
     }
 
-    inline auto set_rasterizer_state( const RasterizerState& state ) -> void {
-        if ( state.cull_faces ) {
-            glEnable( GL_CULL_FACE );
-            glCullFace( state.cull_mode );
-        }
-    }
+    uint32_t offset = 0; // Stream offset of the uniform value
+    uint32_t kind = 0;
+};
 
-    inline auto set_depth_stencil_state( const DepthStencilState& state ) -> void {
-        if ( state.depth_test ) {
-            glEnable( GL_DEPTH_TEST );
-            glDepthFunc( state.depth_func );
+// Commands validated and encoded once, then replayed every frame with only the parameters patched
+class CommandBundle {
+public:
+    auto push( const Command& command ) -> void {
+        if ( const auto u = std::get_if<SetUniformCommand>( &command ); u && u->pid == 0 ) {
+            journal::warning( GRAPHICS_TAG, "Bundle dropped set_uniform with unresolved uniform" );
+            return;
         }
 
-        if ( state.depth_write ) {
-            glDepthMask( GL_TRUE );
-        } else {
-            glDepthMask( GL_FALSE );
+        if ( const auto b = std::get_if<BindBufferCommand>( &command );
+             b && ( b->id == 0 || ( b->type == BufferType::Uniform && b->block_index == -1 ) ) ) {
+            journal::warning( GRAPHICS_TAG, "Bundle dropped bind_buffer with invalid buffer or block" );
+            return;
         }
-    }
 
-    inline auto clear_color_blend_state( [[maybe_unused]] const ColorBlendState& state ) -> void {
-        glDisable( GL_BLEND );
+        _commands.push( command );
+    }
+
+    // Records a set_uniform whose value can be changed after baking
+    template <typename T> auto parameter( const UniformHandle& u, const T& initial ) -> BundleParameter {
+        if ( !u.is_valid( ) ) {
+            journal::warning( GRAPHICS_TAG, "Bundle parameter with unresolved uniform" );
+            return { };
+        }
+
+        const auto offset = static_cast<uint32_t>( _commands.size_bytes( ) );
+        _commands.push( SetUniformCommand { u, initial } );
+
+        return { static_cast<uint32_t>( offset + sizeof( CommandHeader ) + sizeof( UniformRecord ) ),
+            static_cast<uint32_t>( variant_index_v<T, UniformValue> ) };
+    }
+
+    // Invalid parameters were already reported by parameter( )
+    template <typename T> auto set( const BundleParameter& p, const T& value ) noexcept -> void {
+        if ( !p.is_valid( ) )
+            return;
+
+        if ( p.kind != variant_index_v<T, UniformValue> ) {
+            journal::warning( GRAPHICS_TAG, "Bundle parameter set with a value of another type" );
+            return;
+        }
+
+        _commands.patch( p.offset, &value, sizeof value );
+    }
+
+    auto clear( ) noexcept -> void {
+        _commands.clear( );
+    }
+
+    auto commands( ) const noexcept -> const CommandStream& {
+        return _commands;
+    }
+
+private:
+    CommandStream _commands;
+};
+
+inline auto operator<<( CommandBundle& b, const Command& c ) -> CommandBundle& {
+    b.push( c );
+    return b;
+}
+
+inline auto operator<<( CommandQueue& cb, const CommandBundle& b ) -> CommandQueue& {
+    cb.commands.append( b.commands( ) );
+    return cb;
+}
+
+///
+/// Frame hand-over
+///
+
+// Owns the queues of one recorded frame, so recording the next frame can overlap with presenting this one
+struct PresentFrame {
+    // Streams of transient queues are swapped in, persistent queues (presentation_clear == false) are copied
+    auto capture( const CommandQueues& from ) -> void {
+        if ( queues.size( ) < from.size( ) ) {
+            queues.resize( from.size( ) );
+        }
+
+        pointers.clear( );
+
+        for ( size_t i = 0; i < from.size( ); i++ ) {
+            auto& src = *from[i];
+            auto& dst = queues[i];
+
+            dst.clear( );
+            if ( src.presentation_clear ) {
+                std::swap( dst.commands, src.commands );
+            } else {
+                dst.commands.append( src.commands );
+            }
+
+            dst.sorted = src.sorted;
+            dst.coalesce_draws = src.coalesce_draws;
+            dst.color_blend = src.color_blend;
+            dst.rasterizer = src.rasterizer;
+            dst.depth_stencil = src.depth_stencil;
+
+            pointers.push_back( &dst );
+        }
+    }
+
+    std::vector<CommandQueue> queues;
+    CommandQueues pointers;
+};
+
+///
+/// Secondary command buffers
+///
+
+// One buffer per submission index, each recorded by a single worker without locks and merged in index order
+class SecondaryCommandBuffers {
+public:
+    auto resize( size_t count ) -> void {
+        _slots.resize( count );
+    }
+
+    auto size( ) const noexcept -> size_t {
+        return _slots.size( );
+    }
+
+    auto operator[]( size_t index ) noexcept -> CommandBuffer& {
+        return _slots[index].buffer;
+    }
+
+    // Appends every secondary buffer to the queue in submission order and resets them for the next frame
+    auto merge( CommandQueue& queue ) -> void {
+        size_t bytes = queue.commands.size_bytes( );
+        for ( const auto& s : _slots ) {
+            bytes += s.buffer.commands.size_bytes( );
+        }
+
+        queue.commands.reserve( bytes );
+
+        for ( auto& s : _slots ) {
+            queue.commands.append( s.buffer.commands );
+            s.buffer.clear( );
+        }
+    }
+
+private:
+    // Keeps buffers written by different threads on separate cache lines
+    struct alignas( 64 ) Slot {
+        CommandBuffer buffer;
+    };
+
+    std::vector<Slot> _slots;
+};
+
+namespace detail {
+
+    inline auto set_color_blend_state( const ColorBlendState& state ) -> void {
+        state_cache.set_blend( state.enable, state.sfactor, state.dfactor );
+    }
+
+    inline auto set_rasterizer_state( const RasterizerState& state ) -> void {
+        state_cache.set_cull( state.cull_faces, state.cull_mode );
+    }
+
+    inline auto set_depth_stencil_state( const DepthStencilState& state ) -> void {
+        state_cache.set_depth( state.depth_test, state.depth_func, state.depth_write );
+    }
+
+    inline auto clear_color_blend_state( [[maybe_unused]] const ColorBlendState& state ) -> void {
+        state_cache.set_blend( false, state.sfactor, state.dfactor );
     }
 
     inline auto clear_rasterizer_state( [[maybe_unused]] const RasterizerState& state ) -> void {
-        glDisable( GL_CULL_FACE );
+        state_cache.set_cull( false, state.cull_mode );
     }
 
     inline auto clear_depth_stencil_state( [[maybe_unused]] const DepthStencilState& state ) -> void {
-        glDepthMask( GL_TRUE );
-        glDisable( GL_DEPTH_TEST );
+        state_cache.set_depth( false, state.depth_func, true );
     }
 
-    inline auto dispath_uniform( const UniformValue& u, uint32_t pid, int32_t location, uint32_t count ) {
-        if ( pid == 0 )
+    // Calls f with the command stored in the record, uniforms are passed as UniformRecord
+    template <size_t I = 0, typename F> inline auto visit_record( const CommandRecord& r, F&& f ) -> void {
+        if constexpr ( I < std::variant_size_v<Command> ) {
+            using T = std::variant_alternative_t<I, Command>;
+            if ( r.type == I ) {
+                if constexpr ( std::is_same_v<T, SetUniformCommand> ) {
+                    f( r.as<UniformRecord>( ) );
+                } else {
+                    f( r.as<T>( ) );
+                }
+            } else {
+                visit_record<I + 1>( r, std::forward<F>( f ) );
+            }
+        }
+    }
+
+    inline auto dispath_uniform( const UniformRecord& u ) {
+        if ( u.pid == 0 )
             return;
 
-        std::visit(
-            [&]( auto&& arg ) {
-                using T = std::decay_t<decltype( arg )>;
-                if constexpr ( std::is_same_v<T, float> ) {
-                    glProgramUniform1fv(
-                        pid, location, static_cast<GLsizei>( count ), reinterpret_cast<const float*>( &arg ) );
-                } else if constexpr ( std::is_same_v<T, vec2> ) {
-                    glProgramUniform2fv(
-                        pid, location, static_cast<GLsizei>( count ), reinterpret_cast<const float*>( &arg[0] ) );
-                } else if constexpr ( std::is_same_v<T, vec3> ) {
-                    glProgramUniform3fv(
-                        pid, location, static_cast<GLsizei>( count ), reinterpret_cast<const float*>( &arg[0] ) );
-                } else if constexpr ( std::is_same_v<T, vec4> ) {
-                    glProgramUniform4fv(
-                        pid, location, static_cast<GLsizei>( count ), reinterpret_cast<const float*>( &arg[0] ) );
-                } else if constexpr ( std::is_same_v<T, mat4> ) {
-                    glProgramUniformMatrix4fv(
-                        pid, location, count, GL_FALSE, reinterpret_cast<const float*>( &arg[0][0] ) );
-                }
-            },
-            u );
+        const auto count = static_cast<GLsizei>( u.count );
+        const auto data = reinterpret_cast<const float*>( u.data( ) );
+
+        switch ( u.kind ) {
+        case variant_index_v<int, UniformValue>:
+            glProgramUniform1iv( u.pid, u.location, count, reinterpret_cast<const int*>( u.data( ) ) );
+            break;
+        case variant_index_v<float, UniformValue>:
+            glProgramUniform1fv( u.pid, u.location, count, data );
+            break;
+        case variant_index_v<vec2, UniformValue>:
+            glProgramUniform2fv( u.pid, u.location, count, data );
+            break;
+        case variant_index_v<vec3, UniformValue>:
+            glProgramUniform3fv( u.pid, u.location, count, data );
+            break;
+        case variant_index_v<vec4, UniformValue>:
+            glProgramUniform4fv( u.pid, u.location, count, data );
+            break;
+        case variant_index_v<mat4, UniformValue>:
+            glProgramUniformMatrix4fv( u.pid, u.location, count, GL_FALSE, data );
+            break;
+        }
     }
 
     inline auto buffer_type( BufferType type ) {
@@ -574,66 +1884,421 @@ namespace detail {
             return GL_ELEMENT_ARRAY_BUFFER;
         case BufferType::Uniform:
             return GL_UNIFORM_BUFFER;
+        case BufferType::Indirect:
+            return GL_DRAW_INDIRECT_BUFFER;
+        case BufferType::Storage:
+            return GL_SHADER_STORAGE_BUFFER;
         }
 
         return GL_NONE;
     }
 
+    inline auto buffer_usage( BufferUsage usage ) -> GLenum {
+        switch ( usage ) {
+        case BufferUsage::Static:
+            return GL_STATIC_DRAW;
+        case BufferUsage::Dynamic:
+            return GL_DYNAMIC_DRAW;
+        case BufferUsage::Stream:
+            return GL_STREAM_DRAW;
+        }
+
+        return GL_DYNAMIC_DRAW;
+    }
+
+    inline constexpr std::array vertex_layouts = {
+        VertexLayout { },
+#define X( name, vertex, indexed ) make_vertex_layout<vertex>( indexed ),
+        GRAPHICS_VERTEX_FORMATS( X )
+#undef X
+    };
+
+    inline auto vertex_layout( VertexFormat format ) noexcept -> const VertexLayout& {
+        const auto i = static_cast<size_t>( format );
+        return vertex_layouts[i < vertex_layouts.size( ) ? i : 0];
+    }
+
     inline auto have_elements( VertexFormat f ) -> bool {
-        return f != VertexFormat::v3_f32 && f != VertexFormat::unknown;
+        return vertex_layout( f ).indexed;
     }
 
-    inline auto dispath_command( const Command& c, [[maybe_unused]] const CommandBuffer& buf ) -> void {
-        std::visit(
+    inline auto set_vertex_attributes( uint32_t vao, VertexFormat format, uint32_t vb, uint32_t eb ) -> void {
+        const auto& layout = vertex_layout( format );
+        if ( layout.stride == 0 ) {
+            journal::warning( GRAPHICS_TAG, "Unknown vertex format for attributes" );
+            return;
+        }
+
+        for ( uint32_t i = 0; i < layout.num_attributes; i++ ) {
+            const auto& a = layout.attributes[i];
+            glEnableVertexArrayAttrib( vao, a.location );
+            glVertexArrayAttribBinding( vao, a.location, 0 );
+            glVertexArrayAttribFormat( vao, a.location, a.components, a.type, a.normalized, a.offset );
+        }
+
+        glVertexArrayVertexBuffer( vao, 0, vb, 0, static_cast<GLsizei>( layout.stride ) );
+        if ( layout.indexed ) {
+            glVertexArrayElementBuffer( vao, eb );
+        }
+    }
+
+    inline auto vertex_size( VertexFormat format ) noexcept -> uint32_t {
+        return vertex_layout( format ).stride;
+    }
+
+    inline auto index_gl_type( IndexType type ) noexcept -> GLenum {
+        switch ( type ) {
+        case IndexType::u8:
+            return GL_UNSIGNED_BYTE;
+        case IndexType::u16:
+            return GL_UNSIGNED_SHORT;
+        case IndexType::u32:
+            break;
+        }
+
+        return GL_UNSIGNED_INT;
+    }
+
+    inline auto select_index_type( size_t vertices_num ) noexcept -> IndexType {
+        if ( vertices_num <= 0x100 )
+            return IndexType::u8;
+        if ( vertices_num <= 0x10000 )
+            return IndexType::u16;
+        return IndexType::u32;
+    }
+
+    // Calls f with a value of the index element type
+    template <typename F> inline auto visit_index_type( IndexType type, F&& f ) {
+        switch ( type ) {
+        case IndexType::u8:
+            return f( uint8_t { } );
+        case IndexType::u16:
+            return f( uint16_t { } );
+        case IndexType::u32:
+            break;
+        }
+
+        return f( uint32_t { } );
+    }
+
+    inline auto draw_elements_direct( const DrawElementsCommand& d ) -> void {
+        const auto type = index_gl_type( d.index_type );
+        const auto indices = reinterpret_cast<const void*>( size_t { d.first_index } * index_size( d.index_type ) );
+        if ( d.base_instance != 0 ) {
+            glDrawElementsInstancedBaseVertexBaseInstance(
+                GL_TRIANGLES, d.num_elements, type, indices, d.num_instances, d.base_element, d.base_instance );
+        } else if ( d.num_instances == 1 ) {
+            glDrawElementsBaseVertex( GL_TRIANGLES, d.num_elements, type, indices, d.base_element );
+        } else {
+            glDrawElementsInstancedBaseVertex(
+                GL_TRIANGLES, d.num_elements, type, indices, d.num_instances, d.base_element );
+        }
+    }
+
+    struct DrawElementsIndirectCommand {
+        uint32_t count = 0;
+        uint32_t instance_count = 0;
+        uint32_t first_index = 0;
+        int32_t base_vertex = 0;
+        uint32_t base_instance = 0;
+    };
+
+    // Collects consecutive indexed draws, a run is issued as one glMultiDrawElementsIndirect from a streamed buffer
+    struct DrawBatcher {
+        auto begin_frame( ) -> void {
+            offset = 0;
+            if ( buffer != 0 ) {
+                glNamedBufferData( buffer, static_cast<GLsizeiptr>( capacity ), nullptr, GL_STREAM_DRAW );
+            }
+        }
+
+        // A run shares one index type, a different one starts the next run
+        auto push( const DrawElementsCommand& d ) -> void {
+            if ( d.index_type != index_type ) {
+                flush( );
+                index_type = d.index_type;
+            }
+
+            pending.push_back( { d.num_elements, d.num_instances, d.first_index, static_cast<int32_t>( d.base_element ),
+                d.base_instance } );
+        }
+
+        auto flush( ) -> void {
+            if ( pending.empty( ) )
+                return;
+
+            if ( pending.size( ) == 1 ) {
+                const auto& d = pending[0];
+                draw_elements_direct( { .index_type = index_type,
+                    .base_element = static_cast<uint32_t>( d.base_vertex ),
+                    .first_index = d.first_index,
+                    .num_elements = d.count,
+                    .num_instances = d.instance_count,
+                    .base_instance = d.base_instance } );
+            } else {
+                const auto bytes = pending.size( ) * sizeof( DrawElementsIndirectCommand );
+                if ( offset + bytes > capacity ) {
+                    if ( buffer == 0 ) {
+                        glCreateBuffers( 1, &buffer );
+                    }
+
+                    capacity = std::max( { capacity * 2, offset + bytes, size_t { 64 * 1024 } } );
+                    glNamedBufferData( buffer, static_cast<GLsizeiptr>( capacity ), nullptr, GL_STREAM_DRAW );
+                    offset = 0;
+                }
+
+                glNamedBufferSubData( buffer, static_cast<GLintptr>( offset ), static_cast<GLsizeiptr>( bytes ),
+                    pending.data( ) );
+                state_cache.bind_indirect_buffer( buffer );
+                glMultiDrawElementsIndirect( GL_TRIANGLES, index_gl_type( index_type ),
+                    reinterpret_cast<const void*>( offset ), static_cast<GLsizei>( pending.size( ) ), 0 );
+
+                offset += bytes;
+                state_cache.stats.multi_draws++;
+                state_cache.stats.coalesced_draws += static_cast<uint32_t>( pending.size( ) );
+            }
+
+            pending.clear( );
+        }
+
+        uint32_t buffer = 0;
+        size_t capacity = 0;
+        size_t offset = 0;
+        std::vector<DrawElementsIndirectCommand> pending;
+        IndexType index_type = IndexType::u16;
+    };
+
+    inline DrawBatcher draw_batcher;
+
+    // Binds the state cache would skip don't break a run of batched draws
+    inline auto is_redundant_bind( const CommandRecord& c ) noexcept -> bool {
+        if ( const auto p = c.get_if<BindProgramCommand>( ); p )
+            return p->id == state_cache.pipeline;
+        if ( const auto va = c.get_if<BindVertexArrayCommand>( ); va )
+            return va->id == state_cache.vao;
+        if ( const auto fb = c.get_if<BindFramebufferCommand>( ); fb )
+            return fb->id == state_cache.framebuffer;
+        if ( const auto t = c.get_if<BindTextureCommand>( ); t )
+            return t->unit < MAX_CACHED_TEXTURE_UNITS && t->id == state_cache.textures[t->unit];
+        return false;
+    }
+
+    inline auto dispath_command( const CommandRecord& c, [[maybe_unused]] const CommandBuffer& buf ) -> void {
+        if ( !c.is<DrawElementsCommand>( ) && !is_redundant_bind( c ) ) {
+            draw_batcher.flush( );
+        }
+
+        visit_record( c,
             [&]( auto&& arg ) {
                 using T = std::decay_t<decltype( arg )>;
                 if constexpr ( std::is_same_v<T, ClearCommand> ) {
-                    glClipControl( GL_LOWER_LEFT, GL_NEGATIVE_ONE_TO_ONE );
+                    state_cache.clip_control( GL_LOWER_LEFT, GL_NEGATIVE_ONE_TO_ONE );
                     glClearNamedFramebufferfv( arg.fb, GL_COLOR, 0, &arg.color[0] );
                     if ( buf.depth_stencil.depth_write ) {
                         glClearNamedFramebufferfv( arg.fb, GL_DEPTH, 0, &arg.depth );
                     }
-                    glViewportIndexedfv( 0, &arg.viewport[0] );
+                    state_cache.set_viewport( arg.viewport );
                 } else if constexpr ( std::is_same_v<T, BindBufferCommand> ) {
-                    if ( arg.block_index == -1 ) {
+                    if ( arg.block_index == -1 && arg.type == BufferType::Indirect ) {
+                        state_cache.bind_indirect_buffer( arg.id );
+                    } else if ( arg.block_index == -1 ) {
                         glBindBuffer( detail::buffer_type( arg.type ), arg.id );
                     } else {
                         glBindBufferRange(
                             detail::buffer_type( arg.type ), arg.block_index, arg.id, arg.offset, arg.size );
                     }
                 } else if constexpr ( std::is_same_v<T, BindProgramCommand> ) {
-                    glBindProgramPipeline( arg.id );
+                    state_cache.bind_program_pipeline( arg.id );
                 } else if constexpr ( std::is_same_v<T, BindVertexArrayCommand> ) {
-                    glBindVertexArray( arg.id );
+                    state_cache.bind_vertex_array( arg.id );
                 } else if constexpr ( std::is_same_v<T, BindTextureCommand> ) {
-                    glBindTextureUnit( arg.unit, arg.id );
+                    state_cache.bind_texture_unit( arg.unit, arg.id );
                     // glBindSampler( arg.unit, arg.sampler );
                 } else if constexpr ( std::is_same_v<T, BindFramebufferCommand> ) {
-                    glBindFramebuffer( GL_FRAMEBUFFER, arg.id );
+                    state_cache.bind_framebuffer( arg.id );
                 } else if constexpr ( std::is_same_v<T, BlitFramebufferCommand> ) {
                     glBlitNamedFramebuffer( arg.src, arg.dst, arg.src_x, arg.src_y, arg.src_w, arg.src_h, arg.dst_x,
                         arg.dst_y, arg.dst_w, arg.dst_h, GL_COLOR_BUFFER_BIT, GL_LINEAR );
-                } else if constexpr ( std::is_same_v<T, SetUniformCommand> ) {
-                    dispath_uniform( arg.value, arg.pid, arg.location, arg.count );
+                } else if constexpr ( std::is_same_v<T, UniformRecord> ) {
+                    dispath_uniform( arg );
                 } else if constexpr ( std::is_same_v<T, DrawElementsCommand> ) {
-                    if ( have_elements( arg.format ) ) {
-                        if ( arg.num_instances == 1 ) {
-                            glDrawElementsBaseVertex(
-                                GL_TRIANGLES, arg.num_elements, GL_UNSIGNED_SHORT, nullptr, arg.base_element );
-                        } else {
-                            glDrawElementsInstancedBaseVertex( GL_TRIANGLES, arg.num_elements, GL_UNSIGNED_SHORT,
-                                nullptr, arg.num_instances, arg.base_element );
-                        }
+                    if ( have_elements( arg.format ) && buf.coalesce_draws ) {
+                        draw_batcher.push( arg );
+                    } else if ( have_elements( arg.format ) ) {
+                        draw_elements_direct( arg );
                     } else {
-                        if ( arg.num_instances == 1 ) {
+                        if ( arg.base_instance != 0 ) {
+                            glDrawArraysInstancedBaseInstance(
+                                arg.mode, arg.base_element, arg.num_elements, arg.num_instances, arg.base_instance );
+                        } else if ( arg.num_instances == 1 ) {
                             glDrawArrays( arg.mode, arg.base_element, arg.num_elements );
                         } else {
                             glDrawArraysInstanced( arg.mode, arg.base_element, arg.num_elements, arg.num_instances );
                         }
                     }
                 }
-            },
-            c );
+            } );
+    }
+
+    constexpr uint32_t MAX_SORT_PASSES = 0x100;
+    constexpr uint32_t MAX_SORT_STATES = 0xfff;
+
+    // Dense index of an object id in the order of first use this frame, ids past the key width share the last index
+    inline auto sort_index( std::unordered_map<uint32_t, uint32_t>& indices, uint32_t id ) -> uint32_t {
+        const auto [it, added] = indices.try_emplace( id, static_cast<uint32_t>( indices.size( ) ) );
+        return std::min( it->second, MAX_SORT_STATES );
+    }
+
+    // Front to back: pass 8 bits | 0 | pipeline 12 bits | texture 12 bits | vao 12 bits | depth 19 bits
+    // Back to front: pass 8 bits | 1 | inverted depth 19 bits | pipeline 12 bits | texture 12 bits | vao 12 bits
+    // Blended draws follow the opaque draws of their pass and are ordered by depth before state
+    inline auto make_sort_key( uint32_t pass, uint32_t pipeline, uint32_t texture, uint32_t vao, float depth,
+        DepthOrder order ) noexcept -> uint64_t {
+        const auto d = static_cast<uint64_t>( std::clamp( depth, 0.f, 1.f ) * 0x7ffff );
+        const auto state = ( static_cast<uint64_t>( pipeline & 0xfff ) << 24 )
+            | ( static_cast<uint64_t>( texture & 0xfff ) << 12 ) | static_cast<uint64_t>( vao & 0xfff );
+        const auto key = order == DepthOrder::back_to_front ? ( 1ull << 55 ) | ( ( 0x7ffff - d ) << 36 ) | state
+                                                            : ( state << 19 ) | d;
+        return ( static_cast<uint64_t>( pass & 0xff ) << 56 ) | key;
+    }
+
+    // Stable LSD radix sort by 8 bit digits, digits equal for all keys are skipped
+    inline auto radix_sort( std::vector<SortItem>& items, std::vector<SortItem>& scratch ) -> void {
+        scratch.resize( items.size( ) );
+
+        for ( uint32_t shift = 0; shift < 64; shift += 8 ) {
+            std::array<uint32_t, 256> counts = { };
+            for ( const auto& it : items ) {
+                counts[( it.key >> shift ) & 0xff]++;
+            }
+
+            if ( counts[( items[0].key >> shift ) & 0xff] == items.size( ) )
+                continue;
+
+            uint32_t offset = 0;
+            for ( auto& c : counts ) {
+                const auto n = c;
+                c = offset;
+                offset += n;
+            }
+
+            for ( const auto& it : items ) {
+                scratch[counts[( it.key >> shift ) & 0xff]++] = it;
+            }
+
+            items.swap( scratch );
+        }
+    }
+
+    // Identifies the piece of state a command writes, zero for commands without persistent state
+    inline auto state_slot( const CommandRecord& c ) noexcept -> uint64_t {
+        uint64_t slot = 0;
+        visit_record( c, [&]( auto&& arg ) {
+            using T = std::decay_t<decltype( arg )>;
+            if constexpr ( std::is_same_v<T, BindFramebufferCommand> ) {
+                slot = 1ull << 56;
+            } else if constexpr ( std::is_same_v<T, BindProgramCommand> ) {
+                slot = 2ull << 56;
+            } else if constexpr ( std::is_same_v<T, BindVertexArrayCommand> ) {
+                slot = 3ull << 56;
+            } else if constexpr ( std::is_same_v<T, BindTextureCommand> ) {
+                slot = ( 4ull << 56 ) | arg.unit;
+            } else if constexpr ( std::is_same_v<T, BindBufferCommand> ) {
+                slot = ( 5ull << 56 ) | ( static_cast<uint64_t>( arg.type ) << 32 )
+                    | static_cast<uint32_t>( arg.block_index );
+            } else if constexpr ( std::is_same_v<T, UniformRecord> ) {
+                slot = ( 6ull << 56 ) | ( static_cast<uint64_t>( arg.pid & 0xffffff ) << 32 )
+                    | static_cast<uint32_t>( arg.location );
+            }
+        } );
+        return slot;
+    }
+
+    inline auto update_slot( std::vector<StateSlot>& slots, uint64_t slot, uint32_t command ) -> bool {
+        for ( auto& s : slots ) {
+            if ( s.slot == slot ) {
+                if ( s.command == command )
+                    return false;
+
+                s.command = command;
+                return true;
+            }
+        }
+
+        slots.push_back( { slot, command } );
+        return true;
+    }
+
+    inline auto flush_sorted( CommandBuffer& buf ) -> void {
+        auto& st = buf.sort_state;
+        if ( st.packets.empty( ) )
+            return;
+
+        detail::radix_sort( st.items, st.scratch );
+
+        for ( const auto& it : st.items ) {
+            const auto& p = st.packets[it.packet];
+            for ( auto i = p.first_state; i < p.first_state + p.num_states; i++ ) {
+                const auto state = buf.commands.at( st.states[i] );
+                if ( update_slot( st.issued, state_slot( state ), state.offset ) ) {
+                    dispath_command( state, buf );
+                }
+            }
+
+            dispath_command( buf.commands.at( p.draw ), buf );
+        }
+
+        st.clear( );
+    }
+
+    // Every draw becomes a packet holding the commands its state depends on, packets are sorted between barriers
+    inline auto dispath_sorted( CommandBuffer& buf ) -> void {
+        auto& st = buf.sort_state;
+        st.clear( );
+        st.live.clear( );
+        st.issued.clear( );
+        st.pipelines.clear( );
+        st.textures.clear( );
+        st.vaos.clear( );
+
+        // Every framebuffer switch starts a pass, so draws never move across one
+        uint32_t pass = 0, framebuffer = 0, pipeline = 0, texture = 0, vao = 0;
+
+        for ( const auto c : buf.commands ) {
+            if ( c.is<DrawElementsCommand>( ) ) {
+                const auto packet = static_cast<uint32_t>( st.packets.size( ) );
+                st.packets.push_back( { c.offset, static_cast<uint32_t>( st.states.size( ) ),
+                    static_cast<uint32_t>( st.live.size( ) ) } );
+                for ( const auto& l : st.live ) {
+                    st.states.push_back( l.command );
+                }
+
+                const auto& d = c.as<DrawElementsCommand>( );
+                st.items.push_back( { make_sort_key( pass, pipeline, texture, vao, d.depth, d.depth_order ), packet } );
+            } else if ( const auto slot = state_slot( c ); slot != 0 ) {
+                if ( const auto b = c.get_if<BindFramebufferCommand>( ); b && b->id != framebuffer ) {
+                    framebuffer = b->id;
+                    if ( !st.items.empty( ) && ++pass == MAX_SORT_PASSES ) {
+                        flush_sorted( buf );
+                        pass = 0;
+                    }
+                } else if ( const auto b = c.get_if<BindProgramCommand>( ) ) {
+                    pipeline = sort_index( st.pipelines, b->id );
+                } else if ( const auto b = c.get_if<BindVertexArrayCommand>( ) ) {
+                    vao = sort_index( st.vaos, b->id );
+                } else if ( const auto b = c.get_if<BindTextureCommand>( ); b && b->unit == 0 ) {
+                    texture = sort_index( st.textures, b->id );
+                }
+
+                update_slot( st.live, slot, c.offset );
+            } else {
+                flush_sorted( buf );
+                pass = 0;
+                dispath_command( c, buf );
+            }
+        }
+
+        flush_sorted( buf );
     }
 
     inline auto get_program_resources( uint32_t pid, uint32_t program_interface ) {
@@ -764,6 +2429,37 @@ namespace detail {
         }
     }
 
+    // Immutable storage of a 2D texture or a 2D array, the pixels are uploaded by the caller
+    // Returns 0 when the memory budget refuses the texture
+    template <typename Info> inline auto create_texture_storage( GLenum target, const Info& info ) -> uint32_t {
+        const auto layers = target == GL_TEXTURE_2D_ARRAY ? info.depth : 1u;
+        const auto size = texture_size( info.format, info.width, info.height, layers, info.levels );
+        if ( !memory_tracker.reserve( MemoryCategory::texture, size ) )
+            return 0;
+
+        auto internal_format = static_cast<GLint>( 0 );
+        auto format = static_cast<GLenum>( 0 );
+        auto type = static_cast<GLenum>( 0 );
+        get_texture_format_from_pixelformat( info.format, internal_format, format, type );
+
+        auto id = 0u;
+        glCreateTextures( target, 1, &id );
+
+        apply_texture_fitering( id, info.filter, info.levels );
+
+        const auto w = static_cast<GLsizei>( info.width );
+        const auto h = static_cast<GLsizei>( info.height );
+        if ( target == GL_TEXTURE_2D_ARRAY ) {
+            glTextureStorage3D( id, info.levels, internal_format, w, h, static_cast<GLsizei>( info.depth ) );
+        } else {
+            glTextureStorage2D( id, info.levels, internal_format, w, h );
+        }
+
+        memory_tracker.track( MemoryCategory::texture, id, size );
+
+        return id;
+    }
+
 } // namespace detail
 
 ///
@@ -777,9 +2473,18 @@ struct DrawGeometryCommand {
         , el { de } {
     }
 
-    DrawGeometryCommand( const Geometry& g, uint32_t num_instances = 1 )
-        : va { .id = g.vao }
-        , el { .format = g.format, .num_elements = g.num_elements, .num_instances = num_instances } {
+    DrawGeometryCommand( const Geometry& g, uint32_t num_instances = 1, float depth = 0.f, uint32_t base_instance = 0,
+        DepthOrder depth_order = DepthOrder::front_to_back )
+        : va { g.vao }
+        , el { .format = g.format,
+            .index_type = g.index_type,
+            .base_element = g.base_vertex,
+            .first_index = g.first_index,
+            .num_elements = g.num_elements,
+            .num_instances = num_instances,
+            .base_instance = base_instance,
+            .depth = depth,
+            .depth_order = depth_order } {
     }
 
     BindVertexArrayCommand va;
@@ -796,6 +2501,7 @@ using set_uniform = SetUniformCommand;
 using draw_elements = DrawElementsCommand;
 using draw_geometry = DrawGeometryCommand;
 using blit_framebuffer = BlitFramebufferCommand;
+using sequence_barrier = SequenceBarrierCommand;
 
 inline auto operator<<( CommandQueue& cb, const DrawGeometryCommand& c ) -> CommandQueue& {
     cb.push( c.va );
@@ -803,85 +2509,365 @@ inline auto operator<<( CommandQueue& cb, const DrawGeometryCommand& c ) -> Comm
     return cb;
 }
 
+inline auto operator<<( CommandBundle& b, const DrawGeometryCommand& c ) -> CommandBundle& {
+    b.push( c.va );
+    b.push( c.el );
+    return b;
+}
+
 ///
-/// Interface
+/// Capture
 ///
-inline auto present( const CommandQueues& present_queue ) {
-    for ( auto& q : present_queue ) {
-        for ( auto& c : q->commands ) {
-            detail::set_color_blend_state( q->color_blend );
-            detail::set_rasterizer_state( q->rasterizer );
-            detail::set_depth_stencil_state( q->depth_stencil );
+enum class CaptureResource : uint32_t {
+    texture,
+    renderbuffer,
+    framebuffer,
+    shader,
+    program_pipeline,
+    buffer,
+    geometry,
+    geometry_pool,
+};
 
-            detail::dispath_command( c, *q );
+struct CaptureRef {
+    CaptureResource kind = CaptureResource::texture;
+    uint32_t id = 0;
+};
 
-            detail::clear_depth_stencil_state( q->depth_stencil );
-            detail::clear_rasterizer_state( q->rasterizer );
-            detail::clear_color_blend_state( q->color_blend );
-        }
+namespace detail {
 
-        if ( q->presentation_clear ) {
-            q->clear( );
-        }
+    constexpr auto capture_key( CaptureResource kind, uint32_t id ) noexcept -> uint64_t {
+        return ( static_cast<uint64_t>( kind ) << 32 ) | id;
     }
-}
 
-inline auto create_texture( const CreateTextureInfo& info ) noexcept -> Texture {
-    const auto w = static_cast<GLsizei>( info.width );
-    const auto h = static_cast<GLsizei>( info.height );
+    struct CaptureWriter {
+        template <typename T> auto write( const T& v ) -> void {
+            static_assert( std::is_trivially_copyable_v<T> );
+            append( &v, sizeof v );
+        }
 
-    auto internal_format = static_cast<GLint>( 0 );
-    auto format = static_cast<GLenum>( 0 );
-    auto type = static_cast<GLenum>( 0 );
-    detail::get_texture_format_from_pixelformat( info.format, internal_format, format, type );
+        template <typename T> auto write( std::span<const T> v ) -> void {
+            static_assert( std::is_trivially_copyable_v<T> );
+            write( static_cast<uint32_t>( v.size( ) ) );
+            append( v.data( ), v.size( ) * sizeof( T ) );
+        }
 
-    auto id = 0u;
-    glCreateTextures( GL_TEXTURE_2D, 1, &id );
+        template <typename T> auto write( const std::vector<T>& v ) -> void {
+            write( std::span<const T> { v } );
+        }
 
-    detail::apply_texture_fitering( id, info.filter, info.levels );
+        auto write( const std::string& v ) -> void {
+            write( static_cast<uint32_t>( v.size( ) ) );
+            append( v.data( ), v.size( ) );
+        }
 
-    glTextureStorage2D( id, info.levels, internal_format, w, h );
-    if ( const auto pixels = info.pixels.empty( ) ? nullptr : reinterpret_cast<const void*>( &info.pixels[0] );
-         pixels ) {
-        glTextureSubImage2D( id, 0, 0, 0, w, h, format, type, pixels );
-    }
+        auto append( const void* data, size_t size ) -> void {
+            const auto p = reinterpret_cast<const std::byte*>( data );
+            bytes.insert( bytes.end( ), p, p + size );
+        }
 
-    if ( info.mipmaps ) {
-        glGenerateTextureMipmap( id );
-    }
+        std::vector<std::byte> bytes;
+    };
 
-    return { id, GL_TEXTURE_2D, info.width, info.height, 0 };
-}
+    // Creation call of one resource, serialized when it was made
+    struct CaptureEntry {
+        auto depends( CaptureResource kind, uint32_t id ) -> void {
+            deps.push_back( { kind, id } );
+        }
 
-inline auto create_texture_array( const CreateTextureArrayInfo& info ) noexcept -> Texture {
-    const auto w = static_cast<GLsizei>( info.width );
-    const auto h = static_cast<GLsizei>( info.height );
-    const auto d = static_cast<GLsizei>( info.depth );
+        CaptureResource kind = CaptureResource::texture;
+        std::array<uint32_t, 3> ids = { }; // Object id, geometry adds its vertex and element buffers
+        std::vector<CaptureRef> deps;
+        CaptureWriter info;
+    };
 
-    auto internal_format = static_cast<GLint>( 0 );
-    auto format = static_cast<GLenum>( 0 );
-    auto type = static_cast<GLenum>( 0 );
-    detail::get_texture_format_from_pixelformat( info.format, internal_format, format, type );
+    class CaptureReader {
+    public:
+        CaptureReader( const std::byte* data, size_t size )
+            : _data { data }
+            , _size { size } {
+        }
 
-    auto id = 0u;
-    glCreateTextures( GL_TEXTURE_2D_ARRAY, 1, &id );
+        template <typename T> auto read( T& v ) noexcept -> bool {
+            static_assert( std::is_trivially_copyable_v<T> );
+            return read_bytes( &v, sizeof v );
+        }
 
-    detail::apply_texture_fitering( id, info.filter, info.levels );
+        template <typename T> auto read( std::vector<T>& v ) -> bool {
+            static_assert( std::is_trivially_copyable_v<T> );
+            uint32_t count = 0;
+            if ( !read( count ) || count > remaining( ) / sizeof( T ) )
+                return fail( );
+
+            v.resize( count );
+            return read_bytes( v.data( ), count * sizeof( T ) );
+        }
+
+        auto read( std::string& v ) -> bool {
+            uint32_t count = 0;
+            if ( !read( count ) || count > remaining( ) )
+                return fail( );
+
+            v.resize( count );
+            return read_bytes( v.data( ), count );
+        }
+
+        // Sub range of the next bytes, consumed by the caller
+        auto span( size_t size ) noexcept -> const std::byte* {
+            if ( size > remaining( ) ) {
+                fail( );
+                return nullptr;
+            }
+
+            const auto p = _data + _offset;
+            _offset += size;
+            return p;
+        }
+
+        auto remaining( ) const noexcept -> size_t {
+            return _size - _offset;
+        }
+
+        auto is_ok( ) const noexcept -> bool {
+            return _ok;
+        }
+
+    private:
+        auto read_bytes( void* dst, size_t size ) noexcept -> bool {
+            const auto p = span( size );
+            if ( !p )
+                return false;
+
+            if ( size > 0 ) {
+                memcpy( dst, p, size );
+            }
+            return true;
+        }
+
+        auto fail( ) noexcept -> bool {
+            _ok = false;
+            return false;
+        }
+
+        const std::byte* _data = nullptr;
+        size_t _size = 0;
+        size_t _offset = 0;
+        bool _ok = true;
+    };
+
+    // Creation calls of live resources in creation order, so dependencies always come first
+    struct CaptureRegistry {
+        template <typename F>
+        auto record( CaptureResource kind, std::array<uint32_t, 3> ids, F&& serialize ) -> void {
+            if ( !enabled )
+                return;
+
+            auto& e = entries.emplace_back( );
+            e.kind = kind;
+            e.ids = ids;
+            serialize( e );
+        }
+
+        auto forget( CaptureResource kind, uint32_t id ) -> void {
+            std::erase_if( entries, [&]( const CaptureEntry& e ) { return e.kind == kind && e.ids[0] == id; } );
+            if ( kind == CaptureResource::geometry_pool ) {
+                pools.erase( id );
+            }
+        }
+
+        // Only the allocated ranges of a pool are written, so its free lists follow every allocation
+        auto track_pool( const GeometryPool& pool ) -> void {
+            if ( enabled ) {
+                pools[pool.vao] = { pool.free_vertices, pool.free_indices };
+            }
+        }
+
+        bool enabled = false;
+        std::vector<CaptureEntry> entries;
+        std::unordered_map<uint32_t, std::array<std::vector<GeometryRange>, 2>> pools;
+    };
+
+    inline CaptureRegistry capture_registry;
+
+    struct CaptureTextureInfo {
+        uint32_t target = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t depth = 0;
+        PixelFormat format = PixelFormat::unknown;
+        bool mipmaps = true;
+        uint32_t levels = 4;
+        TextureFiltering filter = TextureFiltering::Trilinear;
+    };
+
+    struct CaptureGeometryInfo {
+        uint64_t vertices_num = 0;
+        uint64_t indices_num = 0;
+        vec3 min = vec3 { 0.f };
+        vec3 max = vec3 { 0.f };
+        VertexFormat format = VertexFormat::unknown;
+        IndexType index_type = IndexType::u16;
+    };
+
+    template <typename Info> inline auto capture_texture( CaptureEntry& e, uint32_t target, const Info& info ) {
+        e.info.write( CaptureTextureInfo {
+            target, info.width, info.height, info.depth, info.format, info.mipmaps, info.levels, info.filter } );
+    }
+
+    // Pixels are read back when the capture is written, only which layers were given pixels is kept
+    inline auto capture_layers( CaptureEntry& e, const std::vector<byte_span>& layers ) -> void {
+        e.info.write( static_cast<uint32_t>( layers.size( ) ) );
+        for ( const auto& layer : layers ) {
+            e.info.write( static_cast<uint8_t>( !layer.empty( ) ) );
+        }
+    }
+
+} // namespace detail
+
+///
+/// Interface
+///
+inline auto present( const CommandQueues& present_queue ) {
+    state_cache.stats = { };
+    detail::draw_batcher.begin_frame( );
+
+    for ( auto& q : present_queue ) {
+        detail::set_color_blend_state( q->color_blend );
+        detail::set_rasterizer_state( q->rasterizer );
+        detail::set_depth_stencil_state( q->depth_stencil );
+
+        if ( q->sorted ) {
+            detail::dispath_sorted( *q );
+        } else {
+            for ( const auto c : q->commands ) {
+                detail::dispath_command( c, *q );
+            }
+        }
+
+        detail::draw_batcher.flush( );
+
+        if ( q->presentation_clear ) {
+            q->clear( );
+        }
+    }
+}
+
+namespace detail {
+
+    // Spans without pixels are allowed, the others must cover a whole layer at the texture format
+    inline auto is_pixel_data_valid( PixelFormat format, uint32_t width, uint32_t height,
+        std::span<const byte_span> layers ) noexcept -> bool {
+        const auto size = size_t { width } * height * pixel_size( format );
+        const auto valid = std::all_of(
+            layers.begin( ), layers.end( ), [&]( byte_span p ) { return p.empty( ) || p.size( ) >= size; } );
+        if ( !valid ) {
+            journal::warning( GRAPHICS_TAG, "Texture pixels are smaller than {}x{} at {} bytes per pixel", width,
+                height, pixel_size( format ) );
+        }
+        return valid;
+    }
+
+    // Uploads level 0 of a 2D texture and records its creation, shared by new and recycled textures
+    inline auto fill_texture( uint32_t id, const CreateTextureInfo& info, byte_span pixels ) noexcept -> void {
+        auto internal_format = static_cast<GLint>( 0 );
+        auto format = static_cast<GLenum>( 0 );
+        auto type = static_cast<GLenum>( 0 );
+        get_texture_format_from_pixelformat( info.format, internal_format, format, type );
+
+        if ( !pixels.empty( ) ) {
+            glTextureSubImage2D( id, 0, 0, 0, static_cast<GLsizei>( info.width ), static_cast<GLsizei>( info.height ),
+                format, type, pixels.data( ) );
+        }
+
+        if ( info.mipmaps ) {
+            glGenerateTextureMipmap( id );
+        }
+
+        capture_registry.record( CaptureResource::texture, { id }, [&]( auto& e ) {
+            capture_texture( e, GL_TEXTURE_2D, info );
+            capture_layers( e, { pixels } );
+        } );
+    }
+
+} // namespace detail
+
+// Reads the pixels straight from the span, info.pixels is ignored
+inline auto create_texture( const CreateTextureInfo& info, byte_span pixels ) noexcept -> Texture {
+    if ( !detail::is_pixel_data_valid( info.format, info.width, info.height, { &pixels, 1 } ) )
+        return { };
+
+    const auto id = detail::create_texture_storage( GL_TEXTURE_2D, info );
+    if ( id == 0 )
+        return { };
+
+    detail::fill_texture( id, info, pixels );
+
+    return { id, GL_TEXTURE_2D, info.width, info.height, 0, info.format, info.levels };
+}
+
+inline auto create_texture( const CreateTextureInfo& info ) noexcept -> Texture {
+    return create_texture( info, std::as_bytes( std::span { info.pixels } ) );
+}
+
+namespace detail {
+
+    inline auto layer_spans( const std::vector<u8_buffer>& layers ) -> std::vector<byte_span> {
+        std::vector<byte_span> spans;
+        for ( const auto& l : layers ) {
+            spans.push_back( std::as_bytes( std::span { l } ) );
+        }
+        return spans;
+    }
+
+} // namespace detail
+
+// One span per layer, layers without pixels are left undefined
+inline auto create_texture_array( const CreateTextureArrayInfo& info, const std::vector<byte_span>& layers ) noexcept
+    -> Texture {
+    if ( !detail::is_pixel_data_valid( info.format, info.width, info.height, layers ) )
+        return { };
 
-    glTextureStorage3D( id, info.levels, internal_format, w, h, d );
-    for ( int i = 0; i < d; i++ ) {
-        const auto pixels = info.pixels[i].empty( ) ? nullptr : reinterpret_cast<const void*>( &info.pixels[i][0] );
-        glTextureSubImage3D( id, 0, 0, 0, i, w, h, 1, format, type, pixels );
+    const auto w = static_cast<GLsizei>( info.width );
+    const auto h = static_cast<GLsizei>( info.height );
+    const auto d = static_cast<GLsizei>( info.depth );
+
+    auto internal_format = static_cast<GLint>( 0 );
+    auto format = static_cast<GLenum>( 0 );
+    auto type = static_cast<GLenum>( 0 );
+    detail::get_texture_format_from_pixelformat( info.format, internal_format, format, type );
+
+    const auto id = detail::create_texture_storage( GL_TEXTURE_2D_ARRAY, info );
+    if ( id == 0 )
+        return { };
+
+    for ( int i = 0; i < std::min( d, static_cast<GLsizei>( layers.size( ) ) ); i++ ) {
+        if ( !layers[i].empty( ) ) {
+            glTextureSubImage3D( id, 0, 0, 0, i, w, h, 1, format, type, layers[i].data( ) );
+        }
     }
 
     if ( info.mipmaps ) {
         glGenerateTextureMipmap( id );
     }
 
-    return { id, GL_TEXTURE_2D_ARRAY, info.width, info.height, info.depth };
+    detail::capture_registry.record( CaptureResource::texture, { id }, [&]( auto& e ) {
+        detail::capture_texture( e, GL_TEXTURE_2D_ARRAY, info );
+        detail::capture_layers( e, layers );
+    } );
+
+    return { id, GL_TEXTURE_2D_ARRAY, info.width, info.height, info.depth, info.format, info.levels };
 }
 
-inline auto create_texture_cube( const CreateTextureCubemapInfo& info ) noexcept -> Texture {
+inline auto create_texture_array( const CreateTextureArrayInfo& info ) noexcept -> Texture {
+    return create_texture_array( info, detail::layer_spans( info.pixels ) );
+}
+
+// One span per face in +X, -X, +Y, -Y, +Z, -Z order
+inline auto create_texture_cube( const CreateTextureCubemapInfo& info, const std::vector<byte_span>& faces ) noexcept
+    -> Texture {
+    if ( !detail::is_pixel_data_valid( info.format, info.width, info.height, faces ) )
+        return { };
+
     const auto w = static_cast<GLsizei>( info.width );
     const auto h = static_cast<GLsizei>( info.height );
     const auto d = static_cast<GLsizei>( 6 );
@@ -893,33 +2879,59 @@ inline auto create_texture_cube( const CreateTextureCubemapInfo& info ) noexcept
     auto type = static_cast<GLenum>( 0 );
     detail::get_texture_format_from_pixelformat( info.format, internal_format, format, type );
 
+    const auto size = detail::texture_size( info.format, info.width, info.height, d, levels );
+    if ( !detail::memory_tracker.reserve( MemoryCategory::texture, size ) )
+        return { };
+
     auto id = 0u;
     glCreateTextures( GL_TEXTURE_CUBE_MAP, 1, &id );
 
     detail::apply_texture_fitering( id, info.filter, info.levels );
 
     glTextureStorage2D( id, levels, internal_format, w, h );
+    detail::memory_tracker.track( MemoryCategory::texture, id, size );
 
-    for ( size_t face = 0; face < d; ++face ) {
-        const auto pixels
-            = info.pixels[face].empty( ) ? nullptr : reinterpret_cast<const void*>( &info.pixels[face][0] );
-        glTextureSubImage3D( id, 0, 0, 0, face, w, h, 1, format, type, pixels );
+    for ( size_t face = 0; face < std::min( size_t { d }, faces.size( ) ); ++face ) {
+        if ( !faces[face].empty( ) ) {
+            glTextureSubImage3D( id, 0, 0, 0, face, w, h, 1, format, type, faces[face].data( ) );
+        }
     }
 
     if ( info.mipmaps ) {
         glGenerateTextureMipmap( id );
     }
 
-    return { id, GL_TEXTURE_CUBE_MAP, info.width, info.height, 6 };
+    detail::capture_registry.record( CaptureResource::texture, { id }, [&]( auto& e ) {
+        detail::capture_texture( e, GL_TEXTURE_CUBE_MAP, info );
+        detail::capture_layers( e, faces );
+    } );
+
+    return { id, GL_TEXTURE_CUBE_MAP, info.width, info.height, 6, info.format, levels };
+}
+
+inline auto create_texture_cube( const CreateTextureCubemapInfo& info ) noexcept -> Texture {
+    return create_texture_cube( info, detail::layer_spans( info.pixels ) );
+}
+
+inline auto present_stats( ) noexcept -> const PresentStats& {
+    return state_cache.stats;
 }
 
 inline auto destroy_texture( Texture& t ) noexcept {
+    detail::memory_tracker.release( MemoryCategory::texture, t.id );
+    detail::capture_registry.forget( CaptureResource::texture, t.id );
+    state_cache.forget_texture( t.id );
     glDeleteTextures( 1, &t.id );
 }
 
 inline auto create_renderbuffer( const CreateRenderBufferInfo& info ) -> Renderbuffer {
+    const auto size = detail::texture_size( info.format, info.width, info.height, std::max( info.samples, 1u ), 1 );
+    if ( !detail::memory_tracker.reserve( MemoryCategory::renderbuffer, size ) )
+        return { };
+
     auto id = 0u;
     glCreateRenderbuffers( 1, &id );
+    detail::memory_tracker.track( MemoryCategory::renderbuffer, id, size );
 
     auto internal_format = static_cast<GLint>( 0 );
     auto format = static_cast<GLenum>( 0 );
@@ -935,10 +2947,15 @@ inline auto create_renderbuffer( const CreateRenderBufferInfo& info ) -> Renderb
             static_cast<GLsizei>( info.height ) );
     }
 
+    detail::capture_registry.record(
+        CaptureResource::renderbuffer, { id }, [&]( auto& e ) { e.info.write( info ); } );
+
     return { id, info.width, info.height, info.samples };
 }
 
 inline auto destroy_renderbuffer( Renderbuffer& rb ) noexcept {
+    detail::memory_tracker.release( MemoryCategory::renderbuffer, rb.id );
+    detail::capture_registry.forget( CaptureResource::renderbuffer, rb.id );
     glDeleteRenderbuffers( 1, &rb.id );
 }
 
@@ -998,10 +3015,23 @@ inline auto create_framebuffer( const CreateFramebufferInfo& info ) noexcept ->
 
     const auto status = glCheckNamedFramebufferStatus( id, GL_FRAMEBUFFER );
 
+    detail::capture_registry.record( CaptureResource::framebuffer, { id }, [&]( auto& e ) {
+        e.info.write( info.width );
+        e.info.write( info.height );
+        e.info.write( info.attachments );
+        for ( const auto& a : info.attachments ) {
+            e.depends( a.attachment_target == GL_RENDERBUFFER ? CaptureResource::renderbuffer
+                                                               : CaptureResource::texture,
+                a.render_target );
+        }
+    } );
+
     return { id, info.width, info.height, mask, status };
 }
 
 inline auto destroy_framebuffer( Framebuffer& fb ) noexcept {
+    detail::capture_registry.forget( CaptureResource::framebuffer, fb.id );
+    state_cache.forget_framebuffer( fb.id );
     glDeleteFramebuffers( 1, &fb.id );
 }
 
@@ -1046,10 +3076,16 @@ inline auto create_shader( const CreateShaderInfo& info ) noexcept -> Shader {
         exit( EXIT_FAILURE );
     }
 
+    detail::capture_registry.record( CaptureResource::shader, { id }, [&]( auto& e ) {
+        e.info.write( info.type );
+        e.info.write( info.source );
+    } );
+
     return Shader { id, type };
 }
 
 inline auto destroy_shader( Shader& shader ) noexcept -> void {
+    detail::capture_registry.forget( CaptureResource::shader, shader.id );
     glDeleteProgram( shader.id );
     shader.id = 0;
     shader.target = GL_NONE;
@@ -1108,23 +3144,59 @@ inline auto create_program_pipeline( const CreatePipelineInfo& info ) noexcept -
             std::end( all_uniform_blocks ), std::begin( uniform_blocks ), std::end( uniform_blocks ) );
     }
 
-    return ProgramPipeline { id, all_uniforms, all_attributes, all_uniform_blocks };
+    std::vector<UniformLookup> uniform_lookup;
+    for ( uint32_t i = 0; i < all_uniforms.size( ); i++ ) {
+        uniform_lookup.push_back( { hash_name( all_uniforms[i].name ), i } );
+    }
+
+    std::stable_sort( uniform_lookup.begin( ), uniform_lookup.end( ),
+        []( const UniformLookup& a, const UniformLookup& b ) { return a.hash < b.hash; } );
+
+    for ( size_t i = 1; i < uniform_lookup.size( ); i++ ) {
+        const auto& a = all_uniforms[uniform_lookup[i - 1].index];
+        const auto& b = all_uniforms[uniform_lookup[i].index];
+        if ( uniform_lookup[i - 1].hash == uniform_lookup[i].hash && a.name != b.name ) {
+            journal::warning( GRAPHICS_TAG, "Uniform names '{}' and '{}' have the same hash", a.name, b.name );
+        }
+    }
+
+    detail::capture_registry.record( CaptureResource::program_pipeline, { id }, [&]( auto& e ) {
+        e.info.write( info.shaders );
+        for ( const auto& s : info.shaders ) {
+            e.depends( CaptureResource::shader, s.id );
+        }
+    } );
+
+    return ProgramPipeline { id, all_uniforms, all_attributes, all_uniform_blocks, uniform_lookup };
 }
 
 inline auto destroy_program_pipeline( ProgramPipeline& p ) noexcept {
+    detail::capture_registry.forget( CaptureResource::program_pipeline, p.id );
+    state_cache.forget_program_pipeline( p.id );
     glDeleteProgramPipelines( 1, &p.id );
     p.id = 0;
 }
 
 inline auto create_buffer( const CreateBufferInfo& info ) noexcept -> Buffer {
+    if ( !detail::memory_tracker.reserve( MemoryCategory::buffer, info.size ) )
+        return { };
+
     auto id = 0u;
     glCreateBuffers( 1, &id );
-    glNamedBufferData( id, info.size, info.data, GL_DYNAMIC_DRAW );
+    glNamedBufferData( id, info.size, info.data, detail::buffer_usage( info.usage ) );
+    detail::memory_tracker.track( MemoryCategory::buffer, id, info.size );
+
+    // Contents are read back when the capture is written
+    detail::capture_registry.record(
+        CaptureResource::buffer, { id }, [&]( auto& e ) { e.info.write( static_cast<uint32_t>( info.size ) ); } );
 
-    return { id, static_cast<uint32_t>( info.size ) };
+    return { id, static_cast<uint32_t>( info.size ), { }, info.usage };
 }
 
 inline auto destroy_buffer( Buffer& b ) {
+    detail::memory_tracker.release( MemoryCategory::buffer, b.id );
+    detail::capture_registry.forget( CaptureResource::buffer, b.id );
+    state_cache.forget_buffer( b.id );
     glDeleteBuffers( 1, &b.id );
     b.id = 0;
 }
@@ -1149,164 +3221,3033 @@ template <typename T, size_t N> inline auto update_buffer( Buffer& b, const std:
     glUnmapNamedBuffer( b.id );
 }
 
-inline auto create_geometry( [[maybe_unused]] const CreateGeometryInfo& info ) noexcept -> Geometry {
-    GLuint vbo = 0;
-    GLuint ebo = 0;
-    GLuint vao = 0;
-    uint32_t num_elements = 0;
+inline auto update_buffer( Buffer& b, size_t offset, const void* data, size_t size ) noexcept -> void {
+    if ( offset + size > b.size ) {
+        journal::warning( GRAPHICS_TAG, "Update of {} bytes at {} is outside buffer {}", size, offset, b.id );
+        return;
+    }
 
-    switch ( info.format ) {
-    case VertexFormat::unknown:
-        journal::warning( GRAPHICS_TAG, "Unknown vertex format for buffer" );
-        break;
-    case VertexFormat::v3_f32:
-        glCreateBuffers( 1, &vbo );
-        glNamedBufferData( vbo, info.vertices_num * sizeof( v3_t ), &info.vertices[0], GL_STATIC_DRAW );
-        break;
-    case VertexFormat::v3_f32ui16:
-        glCreateBuffers( 1, &vbo );
-        glCreateBuffers( 1, &ebo );
-        glNamedBufferData( vbo, info.vertices_num * sizeof( v3_t ), &info.vertices[0], GL_STATIC_DRAW );
-        glNamedBufferData( ebo, info.indices_num * sizeof( uint16_t ), &info.indices[0], GL_STATIC_DRAW );
-        break;
-    case VertexFormat::v3n3_f32ui16:
-        glCreateBuffers( 1, &vbo );
-        glCreateBuffers( 1, &ebo );
-        glNamedBufferData( vbo, info.vertices_num * sizeof( v3n3_t ), &info.vertices[0], GL_STATIC_DRAW );
-        glNamedBufferData( ebo, info.indices_num * sizeof( uint16_t ), &info.indices[0], GL_STATIC_DRAW );
-        break;
-    case VertexFormat::v3t2_f32ui16:
-        glCreateBuffers( 1, &vbo );
-        glCreateBuffers( 1, &ebo );
-        glNamedBufferData( vbo, info.vertices_num * sizeof( v3t2_t ), &info.vertices[0], GL_STATIC_DRAW );
-        glNamedBufferData( ebo, info.indices_num * sizeof( uint16_t ), &info.indices[0], GL_STATIC_DRAW );
-        break;
-    case VertexFormat::v3t2n3_f32ui16:
-        glCreateBuffers( 1, &vbo );
-        glCreateBuffers( 1, &ebo );
-        glNamedBufferData( vbo, info.vertices_num * sizeof( v3t2n3_t ), &info.vertices[0], GL_STATIC_DRAW );
-        glNamedBufferData( ebo, info.indices_num * sizeof( uint16_t ), &info.indices[0], GL_STATIC_DRAW );
-        break;
-    case VertexFormat::v3uv2n3t3_f32ui16:
-        glCreateBuffers( 1, &vbo );
-        glCreateBuffers( 1, &ebo );
-        glNamedBufferData( vbo, info.vertices_num * sizeof( v3uv2n3t3_t ), &info.vertices[0], GL_STATIC_DRAW );
-        glNamedBufferData( ebo, info.indices_num * sizeof( uint16_t ), &info.indices[0], GL_STATIC_DRAW );
-        break;
+    glNamedBufferSubData( b.id, static_cast<GLintptr>( offset ), static_cast<GLsizeiptr>( size ), data );
+}
+
+namespace detail {
+
+    // Inserts keeping the ranges sorted, every range it overlaps or touches is merged into it
+    inline auto merge_range( std::vector<BufferRange>& ranges, BufferRange range ) -> void {
+        if ( range.size == 0 )
+            return;
+
+        auto begin = range.offset;
+        auto end = range.offset + range.size;
+
+        // Disjoint sorted ranges have sorted ends too
+        auto first = std::lower_bound( ranges.begin( ), ranges.end( ), begin,
+            []( const BufferRange& r, uint32_t offset ) { return r.offset + r.size < offset; } );
+        auto last = first;
+        for ( ; last != ranges.end( ) && last->offset <= end; ++last ) {
+            begin = std::min( begin, last->offset );
+            end = std::max( end, last->offset + last->size );
+        }
+
+        ranges.insert( ranges.erase( first, last ), { begin, end - begin } );
     }
 
-    glCreateVertexArrays( 1, &vao );
+} // namespace detail
 
-    switch ( info.format ) {
-    case VertexFormat::unknown:
-        journal::warning( GRAPHICS_TAG, "Unknown vertex format for attributes" );
-        break;
-    case VertexFormat::v3_f32:
-        glEnableVertexArrayAttrib( vao, 0 );
-        glVertexArrayAttribBinding( vao, 0, 0 );
-        glVertexArrayAttribFormat( vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof( v3_t, position ) );
+// Records a changed range, written by the next flush_buffer
+inline auto mark_buffer_dirty( Buffer& b, size_t offset, size_t size ) -> void {
+    if ( offset + size > b.size ) {
+        journal::warning( GRAPHICS_TAG, "Dirty range of {} bytes at {} is outside buffer {}", size, offset, b.id );
+        return;
+    }
 
-        glVertexArrayVertexBuffer( vao, 0, vbo, 0, sizeof( v3_t ) );
+    detail::merge_range( b.dirty, { static_cast<uint32_t>( offset ), static_cast<uint32_t>( size ) } );
+}
 
-        num_elements = info.vertices_num;
-        break;
-    case VertexFormat::v3_f32ui16:
-        glEnableVertexArrayAttrib( vao, 0 );
-        glVertexArrayAttribBinding( vao, 0, 0 );
-        glVertexArrayAttribFormat( vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof( v3_t, position ) );
+// Up to this many dirty ranges are written with glNamedBufferSubData, more share one explicitly flushed mapping
+constexpr size_t MAX_BUFFER_SUBDATA_RANGES = 4;
 
-        glVertexArrayVertexBuffer( vao, 0, vbo, 0, sizeof( v3_t ) );
-        glVertexArrayElementBuffer( vao, ebo );
+// Writes only the dirty ranges of contents, the CPU copy of the whole buffer, returns the bytes written
+inline auto flush_buffer( Buffer& b, const void* contents ) noexcept -> size_t {
+    const auto src = static_cast<const std::byte*>( contents );
+    size_t written = 0;
 
-        num_elements = info.indices_num;
-        break;
-    case VertexFormat::v3n3_f32ui16:
-        glEnableVertexArrayAttrib( vao, 0 );
-        glVertexArrayAttribBinding( vao, 0, 0 );
-        glVertexArrayAttribFormat( vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof( v3n3_t, position ) );
+    if ( b.dirty.size( ) <= MAX_BUFFER_SUBDATA_RANGES ) {
+        for ( const auto& r : b.dirty ) {
+            glNamedBufferSubData( b.id, r.offset, r.size, src + r.offset );
+            written += r.size;
+        }
+    } else {
+        const auto begin = b.dirty.front( ).offset;
+        const auto end = b.dirty.back( ).offset + b.dirty.back( ).size;
+        const auto dst = static_cast<std::byte*>(
+            glMapNamedBufferRange( b.id, begin, end - begin, GL_MAP_WRITE_BIT | GL_MAP_FLUSH_EXPLICIT_BIT ) );
+        if ( !dst ) {
+            journal::warning( GRAPHICS_TAG, "Buffer {} couldn't be mapped", b.id );
+            return 0;
+        }
 
-        glEnableVertexArrayAttrib( vao, 2 );
-        glVertexArrayAttribBinding( vao, 2, 0 );
-        glVertexArrayAttribFormat( vao, 2, 3, GL_FLOAT, GL_FALSE, offsetof( v3n3_t, normal ) );
+        for ( const auto& r : b.dirty ) {
+            memcpy( dst + ( r.offset - begin ), src + r.offset, r.size );
+            glFlushMappedNamedBufferRange( b.id, r.offset - begin, r.size );
+            written += r.size;
+        }
+        glUnmapNamedBuffer( b.id );
+    }
 
-        glVertexArrayVertexBuffer( vao, 0, vbo, 0, sizeof( v3n3_t ) );
-        glVertexArrayElementBuffer( vao, ebo );
+    b.dirty.clear( );
+    return written;
+}
 
-        num_elements = info.indices_num;
-        break;
-    case VertexFormat::v3t2_f32ui16:
-        glEnableVertexArrayAttrib( vao, 0 );
-        glVertexArrayAttribBinding( vao, 0, 0 );
-        glVertexArrayAttribFormat( vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof( v3t2_t, position ) );
+template <typename T> inline auto flush_buffer( Buffer& b, const std::vector<T>& contents ) noexcept {
+    return flush_buffer( b, contents.data( ) );
+}
 
-        glEnableVertexArrayAttrib( vao, 1 );
-        glVertexArrayAttribBinding( vao, 1, 0 );
-        glVertexArrayAttribFormat( vao, 1, 2, GL_FLOAT, GL_FALSE, offsetof( v3t2_t, uv ) );
+template <typename T, size_t N> inline auto flush_buffer( Buffer& b, const std::array<T, N>& contents ) noexcept {
+    return flush_buffer( b, contents.data( ) );
+}
 
-        glVertexArrayVertexBuffer( vao, 0, vbo, 0, sizeof( v3t2_t ) );
-        glVertexArrayElementBuffer( vao, ebo );
+namespace detail {
 
-        num_elements = info.indices_num;
-        break;
-    case VertexFormat::v3t2n3_f32ui16:
-        glEnableVertexArrayAttrib( vao, 0 );
-        glVertexArrayAttribBinding( vao, 0, 0 );
-        glVertexArrayAttribFormat( vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof( v3t2n3_t, position ) );
+    // Blocks until the fence signals, flushing the commands before it first
+    inline auto wait_sync( GLsync fence ) noexcept -> GLenum {
+        auto status = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0 );
+        while ( status == GL_TIMEOUT_EXPIRED ) {
+            status = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000 );
+        }
+        return status;
+    }
 
-        glEnableVertexArrayAttrib( vao, 1 );
-        glVertexArrayAttribBinding( vao, 1, 0 );
-        glVertexArrayAttribFormat( vao, 1, 2, GL_FLOAT, GL_FALSE, offsetof( v3t2n3_t, uv ) );
+} // namespace detail
 
-        glEnableVertexArrayAttrib( vao, 2 );
-        glVertexArrayAttribBinding( vao, 2, 0 );
-        glVertexArrayAttribFormat( vao, 2, 3, GL_FLOAT, GL_FALSE, offsetof( v3t2n3_t, normal ) );
+inline auto create_ring_buffer( const CreateRingBufferInfo& info ) noexcept -> RingBuffer {
+    RingBuffer r;
+    r.num_frames = std::clamp( info.frames_in_flight, 1u, MAX_RING_FRAMES );
+
+    // Allocations may be bound as uniform or storage blocks
+    GLint uniform_alignment = 0;
+    GLint storage_alignment = 0;
+    glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment );
+    glGetIntegerv( GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment );
+    r.alignment = static_cast<uint32_t>( std::max( { uniform_alignment, storage_alignment, 256 } ) );
+    r.segment_size = static_cast<uint32_t>( ( info.size + r.alignment - 1 ) & ~size_t { r.alignment - 1 } );
+
+    const auto size = static_cast<GLsizeiptr>( r.segment_size ) * r.num_frames;
+    const auto flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    if ( !detail::memory_tracker.reserve( MemoryCategory::buffer, static_cast<size_t>( size ) ) )
+        return { };
+
+    glCreateBuffers( 1, &r.id );
+    glNamedBufferStorage( r.id, size, nullptr, flags );
+    detail::memory_tracker.track( MemoryCategory::buffer, r.id, static_cast<size_t>( size ) );
+    r.mapped = static_cast<std::byte*>( glMapNamedBufferRange( r.id, 0, size, flags ) );
+
+    if ( !r.mapped ) {
+        journal::warning( GRAPHICS_TAG, "Ring buffer {} couldn't be mapped", r.id );
+    }
 
-        glVertexArrayVertexBuffer( vao, 0, vbo, 0, sizeof( v3t2n3_t ) );
-        glVertexArrayElementBuffer( vao, ebo );
+    detail::capture_registry.record(
+        CaptureResource::buffer, { r.id }, [&]( auto& e ) { e.info.write( static_cast<uint32_t>( size ) ); } );
 
-        num_elements = info.indices_num;
-        break;
-    case VertexFormat::v3uv2n3t3_f32ui16:
-        glEnableVertexArrayAttrib( vao, 0 );
-        glVertexArrayAttribBinding( vao, 0, 0 );
-        glVertexArrayAttribFormat( vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof( v3uv2n3t3_t, position ) );
+    return r;
+}
 
-        glEnableVertexArrayAttrib( vao, 1 );
-        glVertexArrayAttribBinding( vao, 1, 0 );
-        glVertexArrayAttribFormat( vao, 1, 2, GL_FLOAT, GL_FALSE, offsetof( v3uv2n3t3_t, uv ) );
+inline auto destroy_ring_buffer( RingBuffer& r ) noexcept {
+    for ( auto& f : r.fences ) {
+        if ( f ) {
+            glDeleteSync( f );
+            f = nullptr;
+        }
+    }
 
-        glEnableVertexArrayAttrib( vao, 2 );
-        glVertexArrayAttribBinding( vao, 2, 0 );
-        glVertexArrayAttribFormat( vao, 2, 3, GL_FLOAT, GL_FALSE, offsetof( v3uv2n3t3_t, normal ) );
+    detail::memory_tracker.release( MemoryCategory::buffer, r.id );
+    detail::capture_registry.forget( CaptureResource::buffer, r.id );
+    state_cache.forget_buffer( r.id );
+    glUnmapNamedBuffer( r.id );
+    glDeleteBuffers( 1, &r.id );
+    r = { };
+}
 
-        glEnableVertexArrayAttrib( vao, 3 );
-        glVertexArrayAttribBinding( vao, 3, 0 );
-        glVertexArrayAttribFormat( vao, 3, 3, GL_FLOAT, GL_FALSE, offsetof( v3uv2n3t3_t, normal ) );
+// Moves to the next segment, blocking only if the GPU still reads it from num_frames frames ago
+inline auto begin_ring_frame( RingBuffer& r ) noexcept {
+    r.frame = ( r.frame + 1 ) % r.num_frames;
+    r.head = 0;
 
-        glVertexArrayVertexBuffer( vao, 0, vbo, 0, sizeof( v3uv2n3t3_t ) );
-        glVertexArrayElementBuffer( vao, ebo );
+    if ( auto& fence = r.fences[r.frame]; fence ) {
+        if ( detail::wait_sync( fence ) == GL_WAIT_FAILED ) {
+            journal::warning( GRAPHICS_TAG, "Ring buffer {} fence wait failed", r.id );
+        }
 
-        num_elements = info.indices_num;
-        break;
+        glDeleteSync( fence );
+        fence = nullptr;
+    }
+}
+
+// Fences the segment after the commands reading it were presented
+inline auto end_ring_frame( RingBuffer& r ) noexcept {
+    r.fences[r.frame] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+}
+
+inline auto allocate_ring_buffer( RingBuffer& r, size_t size ) noexcept -> RingAllocation {
+    const auto aligned = ( size + r.alignment - 1 ) & ~size_t { r.alignment - 1 };
+    if ( !r.mapped || r.head + aligned > r.segment_size ) {
+        journal::warning( GRAPHICS_TAG, "Ring buffer {} is out of space for {} bytes", r.id, size );
+        return { };
     }
 
-    Geometry g;
-    g.vb = vbo;
-    g.eb = ebo;
-    g.vao = vao;
-    g.num_elements = num_elements;
-    g.format = info.format;
+    const auto offset = r.frame * r.segment_size + r.head;
+    r.head += static_cast<uint32_t>( aligned );
 
-    return g;
+    return { r.id, offset, static_cast<uint32_t>( size ), r.mapped + offset };
 }
 
-inline auto destroy_geometry( Geometry& geometry ) noexcept -> void {
-    glDeleteBuffers( 1, &geometry.vb );
-    geometry.vb = 0;
-    glDeleteBuffers( 1, &geometry.eb );
-    geometry.eb = 0;
-    glDeleteVertexArrays( 1, &geometry.vao );
-    geometry.vao = 0;
+inline auto upload_ring_buffer( RingBuffer& r, const void* data, size_t size ) noexcept -> RingAllocation {
+    const auto a = allocate_ring_buffer( r, size );
+    if ( a.is_valid( ) ) {
+        memcpy( a.data, data, size );
+    }
+    return a;
+}
+
+template <typename T> inline auto upload_ring_buffer( RingBuffer& r, const std::vector<T>& data ) noexcept {
+    return upload_ring_buffer( r, data.data( ), std::size( data ) * sizeof( T ) );
+}
+
+template <typename T, size_t N>
+inline auto upload_ring_buffer( RingBuffer& r, const std::array<T, N>& data ) noexcept {
+    return upload_ring_buffer( r, data.data( ), N * sizeof( T ) );
+}
+
+///
+/// Per-draw data
+///
+
+// Packs one T per draw into a ring allocation bound once per frame, replacing a set_uniform per draw.
+// Draws pass the returned index as base_instance and shaders read draws[gl_BaseInstance].
+template <typename T> class DrawDataStream {
+public:
+    auto begin( RingBuffer& ring, uint32_t max_draws ) -> void {
+        _allocation = allocate_ring_buffer( ring, sizeof( T ) * max_draws );
+        _capacity = _allocation.is_valid( ) ? max_draws : 0;
+        _count = 0;
+        _overflowed = false;
+    }
+
+    // Nothing once the stream is full, the draw must be skipped since no entry holds its data
+    auto push( const T& data ) noexcept -> std::optional<uint32_t> {
+        if ( _count == _capacity ) {
+            if ( !_overflowed ) {
+                journal::warning( GRAPHICS_TAG, "Draw data stream is full at {} draws", _capacity );
+            }
+            _overflowed = true;
+            return std::nullopt;
+        }
+
+        memcpy( static_cast<std::byte*>( _allocation.data ) + _count * sizeof( T ), &data, sizeof( T ) );
+        return _count++;
+    }
+
+    auto size( ) const noexcept -> uint32_t {
+        return _count;
+    }
+
+    auto allocation( ) const noexcept -> const RingAllocation& {
+        return _allocation;
+    }
+
+private:
+    RingAllocation _allocation;
+    uint32_t _capacity = 0;
+    uint32_t _count = 0;
+    bool _overflowed = false; // Warned once per frame
+};
+
+///
+/// Vertex quantization
+///
+namespace detail {
+    // Round to nearest even, overflow goes to infinity
+    inline auto float_to_half( float f ) noexcept -> uint16_t {
+        const auto bits = std::bit_cast<uint32_t>( f );
+        const auto sign = static_cast<uint16_t>( ( bits >> 16 ) & 0x8000u );
+        auto abs = bits & 0x7fffffffu;
+
+        if ( abs >= 0x47800000u )
+            return sign | ( abs > 0x7f800000u ? 0x7e00u : 0x7c00u );
+
+        if ( abs < 0x38800000u ) {
+            const auto denormal = std::bit_cast<float>( abs ) + 0.5f;
+            return sign | static_cast<uint16_t>( std::bit_cast<uint32_t>( denormal ) - 0x3f000000u );
+        }
+
+        const auto odd = ( abs >> 13 ) & 1u;
+        abs += 0xc8000fffu + odd;
+        return sign | static_cast<uint16_t>( abs >> 13 );
+    }
+
+    inline auto encode_half2( vec2 v ) noexcept -> half2 {
+#if defined( __F16C__ )
+        const auto h = static_cast<uint32_t>(
+            _mm_cvtsi128_si32( _mm_cvtps_ph( _mm_set_ps( 0.0f, 0.0f, v.y, v.x ), _MM_FROUND_TO_NEAREST_INT ) ) );
+        return { static_cast<uint16_t>( h & 0xffffu ), static_cast<uint16_t>( h >> 16 ) };
+#else
+        return { float_to_half( v.x ), float_to_half( v.y ) };
+#endif
+    }
+
+    inline auto encode_snorm10( float v ) noexcept -> uint32_t {
+        v = std::clamp( v, -1.0f, 1.0f ) * 511.0f;
+        return static_cast<uint32_t>( static_cast<int32_t>( v + ( v < 0.0f ? -0.5f : 0.5f ) ) ) & 0x3ffu;
+    }
+
+    inline auto encode_snorm10x3( vec3 v ) noexcept -> snorm10x3 {
+        return { encode_snorm10( v.x ) | encode_snorm10( v.y ) << 10 | encode_snorm10( v.z ) << 20 };
+    }
+
+    template <typename T>
+    auto position_bounds( std::span<const T> vertices ) noexcept -> std::pair<vec3, vec3> {
+        auto lo = vec3 { std::numeric_limits<float>::max( ) };
+        auto hi = vec3 { std::numeric_limits<float>::lowest( ) };
+#if defined( __SSE2__ )
+        static_assert( offsetof( T, position ) + sizeof( float ) * 4 <= sizeof( T ) );
+
+        auto min = _mm_set1_ps( lo.x );
+        auto max = _mm_set1_ps( hi.x );
+        for ( const auto& v : vertices ) {
+            const auto p = _mm_loadu_ps( &v.position.x );
+            min = _mm_min_ps( min, p );
+            max = _mm_max_ps( max, p );
+        }
+
+        alignas( 16 ) float out[8];
+        _mm_store_ps( out, min );
+        _mm_store_ps( out + 4, max );
+        lo = { out[0], out[1], out[2] };
+        hi = { out[4], out[5], out[6] };
+#else
+        for ( const auto& v : vertices ) {
+            lo = glm::min( lo, v.position );
+            hi = glm::max( hi, v.position );
+        }
+#endif
+        return { lo, hi };
+    }
+
+    inline auto make_position_quantization( vec3 lo, vec3 hi ) noexcept -> PositionQuantization {
+        if ( lo.x > hi.x )
+            return { };
+
+        // A flat axis encodes to 0 at any scale, a small one keeps the inverse finite
+        const auto extent = ( hi - lo ) * 0.5f;
+        const auto largest = std::max( { extent.x, extent.y, extent.z } );
+        const auto flat = largest > 0.0f ? largest * 1e-6f : 1.0f;
+        return { ( lo + hi ) * 0.5f, glm::max( extent, vec3 { flat } ) };
+    }
+
+    // SSE path reads the float after the position, masked out of the result
+    template <typename T>
+    auto quantize_positions( std::span<const T> vertices, const PositionQuantization& q, auto&& out ) noexcept
+        -> void {
+        const auto inv = 32767.0f / q.scale;
+#if defined( __SSE2__ )
+        const auto offset = _mm_set_ps( 0.0f, q.offset.z, q.offset.y, q.offset.x );
+        const auto scale = _mm_set_ps( 0.0f, inv.z, inv.y, inv.x );
+        const auto mask = _mm_castsi128_ps( _mm_set_epi32( 0, -1, -1, -1 ) );
+        for ( size_t i = 0; i < vertices.size( ); i++ ) {
+            const auto p = _mm_and_ps( _mm_loadu_ps( &vertices[i].position.x ), mask );
+            const auto v = _mm_cvtps_epi32( _mm_mul_ps( _mm_sub_ps( p, offset ), scale ) );
+            _mm_storel_epi64( reinterpret_cast<__m128i*>( &out( i ) ), _mm_packs_epi32( v, v ) );
+        }
+#else
+        for ( size_t i = 0; i < vertices.size( ); i++ ) {
+            const auto p = glm::clamp( glm::round( ( vertices[i].position - q.offset ) * inv ), -32767.0f, 32767.0f );
+            out( i ) = { static_cast<int16_t>( p.x ), static_cast<int16_t>( p.y ), static_cast<int16_t>( p.z ), 0 };
+        }
+#endif
+    }
+} // namespace detail
+
+// Encodes at build time, positions to snorm16 in the mesh bounds, uvs to half and normals to snorm 10-10-10-2
+inline auto quantize_vertices( std::span<const v3t2n3_t> vertices, std::span<v3t2n3_q16_t> out ) noexcept
+    -> PositionQuantization {
+    if ( out.size( ) < vertices.size( ) ) {
+        journal::warning( GRAPHICS_TAG, "Quantized vertices need {} entries, have {}", vertices.size( ), out.size( ) );
+        return { };
+    }
+
+    const auto [lo, hi] = detail::position_bounds( vertices );
+    const auto q = detail::make_position_quantization( lo, hi );
+
+    detail::quantize_positions( vertices, q, [&]( size_t i ) -> snorm16x3& { return out[i].position; } );
+    for ( size_t i = 0; i < vertices.size( ); i++ ) {
+        out[i].uv = detail::encode_half2( vertices[i].uv );
+        out[i].normal = detail::encode_snorm10x3( vertices[i].normal );
+    }
+
+    return q;
+}
+
+inline auto quantize_vertices( std::span<const v3uv2n3t3_t> vertices, std::span<v3uv2n3t3_q16_t> out ) noexcept
+    -> PositionQuantization {
+    if ( out.size( ) < vertices.size( ) ) {
+        journal::warning( GRAPHICS_TAG, "Quantized vertices need {} entries, have {}", vertices.size( ), out.size( ) );
+        return { };
+    }
+
+    const auto [lo, hi] = detail::position_bounds( vertices );
+    const auto q = detail::make_position_quantization( lo, hi );
+
+    detail::quantize_positions( vertices, q, [&]( size_t i ) -> snorm16x3& { return out[i].position; } );
+    for ( size_t i = 0; i < vertices.size( ); i++ ) {
+        out[i].uv = detail::encode_half2( vertices[i].uv );
+        out[i].normal = detail::encode_snorm10x3( vertices[i].normal );
+        out[i].tangent = detail::encode_snorm10x3( vertices[i].tangent );
+    }
+
+    return q;
+}
+
+///
+/// Mesh optimization
+///
+constexpr uint32_t VERTEX_CACHE_SIZE = 16; // FIFO entries assumed by the optimizer and the statistics
+
+// Post-transform cache behaviour of an index order, ACMR counts transforms per triangle and ATVR per used vertex
+struct VertexCacheStats {
+    auto acmr( ) const noexcept -> float {
+        return triangles > 0 ? static_cast<float>( transforms ) / static_cast<float>( triangles ) : 0.f;
+    }
+
+    auto atvr( ) const noexcept -> float {
+        return vertices > 0 ? static_cast<float>( transforms ) / static_cast<float>( vertices ) : 0.f;
+    }
+
+    uint64_t transforms = 0;
+    uint64_t triangles = 0;
+    uint64_t vertices = 0;
+};
+
+struct MeshOptimizationStats {
+    VertexCacheStats before;
+    VertexCacheStats after;
+    uint64_t meshes = 0;
+};
+
+struct OptimizeMeshInfo {
+    uint32_t cache_size = VERTEX_CACHE_SIZE;
+    float overdraw_threshold = 1.05f; // ACMR allowed over the cache order to split clusters, 0 skips overdraw sorting
+};
+
+inline auto analyze_vertex_cache( std::span<const uint32_t> indices, size_t vertices_num,
+    uint32_t cache_size = VERTEX_CACHE_SIZE ) noexcept -> VertexCacheStats {
+    VertexCacheStats stats;
+    stats.triangles = indices.size( ) / 3;
+
+    // A vertex is cached while fewer than cache_size misses happened after its own
+    std::vector<uint64_t> stamps( vertices_num, 0 );
+    uint64_t time = cache_size;
+    for ( const auto i : indices ) {
+        if ( i >= vertices_num )
+            continue;
+
+        if ( stamps[i] == 0 ) {
+            stats.vertices++;
+        }
+        if ( time - stamps[i] >= cache_size ) {
+            stamps[i] = ++time;
+            stats.transforms++;
+        }
+    }
+
+    return stats;
+}
+
+namespace detail {
+
+    inline MeshOptimizationStats mesh_optimization_totals;
+
+    // Triangles around each vertex, offsets has one entry per vertex and one past the end
+    struct VertexAdjacency {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> triangles;
+    };
+
+    inline auto build_adjacency( std::span<const uint32_t> indices, size_t vertices_num ) -> VertexAdjacency {
+        VertexAdjacency a;
+        a.offsets.assign( vertices_num + 1, 0 );
+        for ( const auto i : indices ) {
+            a.offsets[i + 1]++;
+        }
+        for ( size_t v = 0; v < vertices_num; v++ ) {
+            a.offsets[v + 1] += a.offsets[v];
+        }
+
+        auto fill = a.offsets;
+        a.triangles.resize( indices.size( ) );
+        for ( size_t i = 0; i < indices.size( ); i++ ) {
+            a.triangles[fill[indices[i]]++] = static_cast<uint32_t>( i / 3 );
+        }
+
+        return a;
+    }
+
+    // Tipsify, Sander et al. 2007. Fans around the cached vertex with most remaining triangles that still fit the
+    // cache, boundaries collects where the order had to jump away from the cache
+    inline auto tipsify( std::span<const uint32_t> indices, size_t vertices_num, uint32_t cache_size,
+        std::vector<uint32_t>& order, std::vector<uint32_t>& boundaries ) -> void {
+        const auto adjacency = build_adjacency( indices, vertices_num );
+
+        std::vector<uint32_t> live( vertices_num );
+        for ( size_t v = 0; v < vertices_num; v++ ) {
+            live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+        }
+
+        std::vector<uint64_t> stamps( vertices_num, 0 );
+        std::vector<bool> emitted( indices.size( ) / 3, false );
+        std::vector<uint32_t> dead_end;
+        std::vector<uint32_t> candidates;
+        uint64_t time = cache_size + 1;
+        uint32_t cursor = 0;
+
+        const auto skip_dead_end = [&]( ) -> std::optional<uint32_t> {
+            while ( !dead_end.empty( ) ) {
+                const auto v = dead_end.back( );
+                dead_end.pop_back( );
+                if ( live[v] > 0 )
+                    return v;
+            }
+            for ( ; cursor < vertices_num; cursor++ ) {
+                if ( live[cursor] > 0 )
+                    return cursor;
+            }
+            return std::nullopt;
+        };
+
+        order.clear( );
+        boundaries.assign( 1, 0 );
+
+        auto fan = skip_dead_end( );
+        while ( fan ) {
+            candidates.clear( );
+            for ( auto t = adjacency.offsets[*fan]; t < adjacency.offsets[*fan + 1]; t++ ) {
+                const auto triangle = adjacency.triangles[t];
+                if ( emitted[triangle] )
+                    continue;
+
+                emitted[triangle] = true;
+                order.push_back( triangle );
+                for ( uint32_t k = 0; k < 3; k++ ) {
+                    const auto v = indices[triangle * 3 + k];
+                    dead_end.push_back( v );
+                    candidates.push_back( v );
+                    live[v]--;
+                    if ( time - stamps[v] > cache_size ) {
+                        stamps[v] = time++;
+                    }
+                }
+            }
+
+            std::optional<uint32_t> best;
+            int64_t priority = -1;
+            for ( const auto v : candidates ) {
+                if ( live[v] == 0 )
+                    continue;
+
+                const auto age = static_cast<int64_t>( time - stamps[v] );
+                const auto p = age + 2 * int64_t { live[v] } <= int64_t { cache_size } ? age : 0;
+                if ( p > priority ) {
+                    best = v;
+                    priority = p;
+                }
+            }
+
+            if ( !best ) {
+                best = skip_dead_end( );
+                if ( best && order.size( ) > boundaries.back( ) ) {
+                    boundaries.push_back( static_cast<uint32_t>( order.size( ) ) );
+                }
+            }
+
+            fan = best;
+        }
+    }
+
+    // Position of every vertex when the format has a float or snorm16 position at location 0
+    inline auto read_positions( VertexFormat format, byte_span vertices ) -> std::vector<vec3> {
+        const auto& layout = vertex_layout( format );
+        const auto attributes = std::span { layout.attributes }.first( layout.num_attributes );
+        const auto position = std::find_if( attributes.begin( ), attributes.end( ),
+            []( const VertexAttribute& a ) { return a.location == 0 && a.components >= 3; } );
+        if ( layout.stride == 0 || position == attributes.end( ) )
+            return { };
+
+        std::vector<vec3> positions( vertices.size( ) / layout.stride );
+        for ( size_t v = 0; v < positions.size( ); v++ ) {
+            const auto data = vertices.data( ) + v * layout.stride + position->offset;
+            if ( position->type == GL_FLOAT ) {
+                memcpy( &positions[v], data, sizeof( vec3 ) );
+            } else if ( position->type == GL_SHORT ) {
+                int16_t p[3];
+                memcpy( p, data, sizeof p );
+                positions[v] = vec3 { p[0], p[1], p[2] } / 32767.f;
+            } else {
+                return { };
+            }
+        }
+
+        return positions;
+    }
+
+    // Splits the Tipsify clusters once their own ACMR is low enough and draws them outside in, so front faces tend
+    // to come first. Fast triangle reordering for vertex locality and reduced overdraw, Sander et al. 2007
+    inline auto sort_clusters( std::span<const uint32_t> indices, std::span<const vec3> positions,
+        std::vector<uint32_t>& order, const std::vector<uint32_t>& boundaries, uint32_t cache_size, float threshold )
+        -> void {
+        std::vector<uint32_t> ordered;
+        ordered.reserve( indices.size( ) );
+        for ( const auto t : order ) {
+            ordered.insert( ordered.end( ), indices.begin( ) + t * 3, indices.begin( ) + t * 3 + 3 );
+        }
+        const auto target = analyze_vertex_cache( ordered, positions.size( ), cache_size ).acmr( ) * threshold;
+
+        std::vector<uint32_t> clusters;
+        std::vector<uint64_t> stamps( positions.size( ), 0 );
+        uint64_t time = cache_size;
+        for ( size_t c = 0; c < boundaries.size( ); c++ ) {
+            const auto end = c + 1 < boundaries.size( ) ? boundaries[c + 1] : static_cast<uint32_t>( order.size( ) );
+            uint32_t start = boundaries[c];
+            uint32_t misses = 0;
+            time += cache_size;
+            clusters.push_back( start );
+
+            for ( auto t = start; t < end; t++ ) {
+                for ( uint32_t k = 0; k < 3; k++ ) {
+                    const auto v = indices[order[t] * 3 + k];
+                    if ( time - stamps[v] >= cache_size ) {
+                        stamps[v] = ++time;
+                        misses++;
+                    }
+                }
+
+                if ( t + 1 < end && static_cast<float>( misses ) <= target * static_cast<float>( t + 1 - start ) ) {
+                    start = t + 1;
+                    misses = 0;
+                    time += cache_size;
+                    clusters.push_back( start );
+                }
+            }
+        }
+
+        struct Cluster {
+            uint32_t begin;
+            uint32_t end;
+            float sort;
+        };
+
+        const auto triangle_normal = [&]( uint32_t t, vec3& centroid ) {
+            const auto& p0 = positions[indices[t * 3]];
+            const auto& p1 = positions[indices[t * 3 + 1]];
+            const auto& p2 = positions[indices[t * 3 + 2]];
+            centroid = ( p0 + p1 + p2 ) / 3.f;
+            return glm::cross( p1 - p0, p2 - p0 ); // Length is twice the area
+        };
+
+        vec3 mesh_centroid { 0.f };
+        float mesh_area = 0.f;
+        for ( const auto t : order ) {
+            vec3 centroid;
+            const auto area = glm::length( triangle_normal( t, centroid ) );
+            mesh_centroid += centroid * area;
+            mesh_area += area;
+        }
+        mesh_centroid = mesh_area > 0.f ? mesh_centroid / mesh_area : mesh_centroid;
+
+        std::vector<Cluster> sorted;
+        for ( size_t c = 0; c < clusters.size( ); c++ ) {
+            const auto end = c + 1 < clusters.size( ) ? clusters[c + 1] : static_cast<uint32_t>( order.size( ) );
+            vec3 centroid_sum { 0.f };
+            vec3 normal { 0.f };
+            float area = 0.f;
+            for ( auto t = clusters[c]; t < end; t++ ) {
+                vec3 centroid;
+                const auto n = triangle_normal( order[t], centroid );
+                centroid_sum += centroid * glm::length( n );
+                area += glm::length( n );
+                normal += n;
+            }
+
+            const auto length = glm::length( normal );
+            const auto sort = area > 0.f && length > 0.f
+                                ? glm::dot( centroid_sum / area - mesh_centroid, normal / length )
+                                : 0.f;
+            sorted.push_back( { clusters[c], end, sort } );
+        }
+
+        std::stable_sort( sorted.begin( ), sorted.end( ),
+            []( const Cluster& a, const Cluster& b ) { return a.sort > b.sort; } );
+
+        std::vector<uint32_t> reordered;
+        reordered.reserve( order.size( ) );
+        for ( const auto& c : sorted ) {
+            reordered.insert( reordered.end( ), order.begin( ) + c.begin, order.begin( ) + c.end );
+        }
+        order = std::move( reordered );
+    }
+
+    inline auto reorder_triangles( std::span<uint32_t> indices, const std::vector<uint32_t>& order ) -> void {
+        const std::vector<uint32_t> source( indices.begin( ), indices.end( ) );
+        for ( size_t t = 0; t < order.size( ); t++ ) {
+            std::copy_n( source.begin( ) + order[t] * 3, 3, indices.begin( ) + static_cast<std::ptrdiff_t>( t * 3 ) );
+        }
+    }
+
+    // Moves vertices into first use order and remaps the indices, unused vertices keep their order at the end
+    inline auto optimize_vertex_fetch( std::span<std::byte> vertices, uint32_t stride, std::span<uint32_t> indices )
+        -> void {
+        const auto count = vertices.size( ) / stride;
+        std::vector<uint32_t> remap( count, std::numeric_limits<uint32_t>::max( ) );
+        uint32_t next = 0;
+        for ( auto& i : indices ) {
+            if ( remap[i] == std::numeric_limits<uint32_t>::max( ) ) {
+                remap[i] = next++;
+            }
+            i = remap[i];
+        }
+        for ( auto& r : remap ) {
+            if ( r == std::numeric_limits<uint32_t>::max( ) ) {
+                r = next++;
+            }
+        }
+
+        const std::vector<std::byte> source( vertices.begin( ), vertices.end( ) );
+        for ( size_t v = 0; v < count; v++ ) {
+            memcpy( vertices.data( ) + size_t { remap[v] } * stride, source.data( ) + v * stride, stride );
+        }
+    }
+
+} // namespace detail
+
+// Reorders triangles for the post-transform cache, sorts their clusters against overdraw and finally orders the
+// vertices by first use. Runs on the CPU at build time, in place
+inline auto optimize_mesh( VertexFormat format, std::span<std::byte> vertices, std::span<uint32_t> indices,
+    const OptimizeMeshInfo& info = { } ) -> MeshOptimizationStats {
+    const auto stride = detail::vertex_size( format );
+    if ( stride == 0 || !detail::have_elements( format ) || indices.size( ) % 3 != 0 ) {
+        journal::warning( GRAPHICS_TAG, "Mesh optimization needs indexed triangles of a known vertex format" );
+        return { };
+    }
+
+    const auto vertices_num = vertices.size( ) / stride;
+    if ( std::any_of( indices.begin( ), indices.end( ), [&]( uint32_t i ) { return i >= vertices_num; } ) ) {
+        journal::warning( GRAPHICS_TAG, "Mesh indices address more than {} vertices", vertices_num );
+        return { };
+    }
+
+    MeshOptimizationStats stats;
+    stats.meshes = 1;
+    stats.before = analyze_vertex_cache( indices, vertices_num, info.cache_size );
+
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> boundaries;
+    detail::tipsify( indices, vertices_num, info.cache_size, order, boundaries );
+
+    if ( info.overdraw_threshold > 0.f ) {
+        if ( const auto positions = detail::read_positions( format, vertices ); !positions.empty( ) ) {
+            detail::sort_clusters( indices, positions, order, boundaries, info.cache_size, info.overdraw_threshold );
+        }
+    }
+
+    detail::reorder_triangles( indices, order );
+    detail::optimize_vertex_fetch( vertices, stride, indices );
+    stats.after = analyze_vertex_cache( indices, vertices_num, info.cache_size );
+
+    const auto accumulate = []( VertexCacheStats& total, const VertexCacheStats& s ) {
+        total.transforms += s.transforms;
+        total.triangles += s.triangles;
+        total.vertices += s.vertices;
+    };
+    accumulate( detail::mesh_optimization_totals.before, stats.before );
+    accumulate( detail::mesh_optimization_totals.after, stats.after );
+    detail::mesh_optimization_totals.meshes++;
+
+    return stats;
+}
+
+// Triangle order only, for index ranges that share their vertices with other ranges such as levels of detail
+inline auto optimize_vertex_cache( std::span<uint32_t> indices, size_t vertices_num,
+    uint32_t cache_size = VERTEX_CACHE_SIZE ) -> void {
+    if ( indices.size( ) % 3 != 0
+         || std::any_of( indices.begin( ), indices.end( ), [&]( uint32_t i ) { return i >= vertices_num; } ) ) {
+        journal::warning( GRAPHICS_TAG, "Vertex cache optimization needs triangles within {} vertices", vertices_num );
+        return;
+    }
+
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> boundaries;
+    detail::tipsify( indices, vertices_num, cache_size, order, boundaries );
+    detail::reorder_triangles( indices, order );
+}
+
+// Sums over every optimize_mesh call, including geometry created with CreateGeometryInfo::optimize
+inline auto mesh_optimization_stats( ) noexcept -> const MeshOptimizationStats& {
+    return detail::mesh_optimization_totals;
+}
+
+///
+/// Mesh simplification
+///
+struct LodChainInfo {
+    uint32_t max_lods = 4; // Including the full mesh, at most MAX_GEOMETRY_LODS
+    float reduction = 0.5f; // Triangles kept from one level to the next
+    float max_error = 0.02f; // Relative to the radius of the mesh bounds, ends the chain early
+};
+
+namespace detail {
+
+    // Sum of squared distances to a set of planes, upper triangle of the symmetric 4x4 matrix
+    struct Quadric {
+        auto add( const Quadric& q ) noexcept -> void {
+            for ( size_t i = 0; i < m.size( ); i++ ) {
+                m[i] += q.m[i];
+            }
+        }
+
+        auto error( const vec3& p ) const noexcept -> double {
+            const double x = p.x, y = p.y, z = p.z;
+            return m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x + m[4] * y * y
+                 + 2 * m[5] * y * z + 2 * m[6] * y + m[7] * z * z + 2 * m[8] * z + m[9];
+        }
+
+        static auto plane( const vec3& n, float d ) noexcept -> Quadric {
+            const double a = n.x, b = n.y, c = n.z, w = d;
+            return { { a * a, a * b, a * c, a * w, b * b, b * c, b * w, c * c, c * w, w * w } };
+        }
+
+        std::array<double, 10> m = { };
+    };
+
+    // Vertices sharing a position are welded to the first of them, so the two sides of an attribute seam simplify as
+    // one surface
+    inline auto weld_positions( std::span<const vec3> positions ) -> std::vector<uint32_t> {
+        std::vector<uint32_t> sorted( positions.size( ) );
+        for ( uint32_t v = 0; v < sorted.size( ); v++ ) {
+            sorted[v] = v;
+        }
+        const auto key = [&]( uint32_t v ) { return std::tie( positions[v].x, positions[v].y, positions[v].z ); };
+        std::stable_sort(
+            sorted.begin( ), sorted.end( ), [&]( uint32_t a, uint32_t b ) { return key( a ) < key( b ); } );
+
+        std::vector<uint32_t> welded( positions.size( ) );
+        for ( size_t i = 0; i < sorted.size( ); i++ ) {
+            const auto same = i > 0 && key( sorted[i] ) == key( sorted[i - 1] );
+            welded[sorted[i]] = same ? welded[sorted[i - 1]] : sorted[i];
+        }
+        return welded;
+    }
+
+    // Vertices of welded edges used by one triangle sit on a border and stay so the simplified surface doesn't tear
+    inline auto find_border_vertices( std::span<const uint32_t> triangles, size_t vertices_num,
+        std::unordered_map<uint64_t, uint32_t>& edges ) -> std::vector<bool> {
+        std::vector<bool> locked( vertices_num, false );
+
+        for ( size_t t = 0; t < triangles.size( ); t += 3 ) {
+            for ( uint32_t k = 0; k < 3; k++ ) {
+                const auto a = triangles[t + k];
+                const auto b = triangles[t + ( k + 1 ) % 3];
+                edges[uint64_t { std::min( a, b ) } << 32 | std::max( a, b )]++;
+            }
+        }
+        for ( const auto& [edge, count] : edges ) {
+            if ( count == 1 ) {
+                locked[edge >> 32] = true;
+                locked[edge & 0xffffffffu] = true;
+            }
+        }
+
+        return locked;
+    }
+
+    // Collapses edges onto one of their vertices in order of quadric error, Garland and Heckbert 1997, until
+    // target_indices remain or the next collapse exceeds max_error. No vertex is moved or added, so every level can
+    // index the original vertices. Returns the largest collapse error as a distance
+    inline auto simplify( std::span<const uint32_t> indices, std::span<const vec3> positions, size_t target_indices,
+        float max_error, std::vector<uint32_t>& out ) -> float {
+        const auto vertices_num = positions.size( );
+        const auto welded = weld_positions( positions );
+
+        // Collapses run on welded vertices, wedges keep the vertex each corner really indexes
+        std::vector<uint32_t> wedges( indices.begin( ), indices.end( ) );
+        std::vector<uint32_t> triangles( indices.size( ) );
+        std::transform( indices.begin( ), indices.end( ), triangles.begin( ), [&]( uint32_t v ) { return welded[v]; } );
+        std::vector<bool> dead( triangles.size( ) / 3, false );
+        std::vector<std::vector<uint32_t>> around( vertices_num );
+        std::vector<Quadric> quadrics( vertices_num );
+
+        const auto normal = [&]( uint32_t t ) {
+            const auto& p0 = positions[triangles[t * 3]];
+            return glm::cross( positions[triangles[t * 3 + 1]] - p0, positions[triangles[t * 3 + 2]] - p0 );
+        };
+
+        for ( uint32_t t = 0; t < dead.size( ); t++ ) {
+            const auto n = normal( t );
+            const auto length = glm::length( n );
+            const auto unit = length > 0.f ? n / length : vec3 { 0.f };
+            const auto q = Quadric::plane( unit, -glm::dot( unit, positions[triangles[t * 3]] ) );
+            for ( uint32_t k = 0; k < 3; k++ ) {
+                quadrics[triangles[t * 3 + k]].add( q );
+                around[triangles[t * 3 + k]].push_back( t );
+            }
+        }
+
+        std::unordered_map<uint64_t, uint32_t> edges;
+        const auto locked = find_border_vertices( triangles, vertices_num, edges );
+
+        struct Collapse {
+            double cost;
+            uint32_t from;
+            uint32_t to;
+            uint32_t from_version;
+            uint32_t to_version;
+
+            auto operator>( const Collapse& c ) const noexcept -> bool {
+                return cost > c.cost;
+            }
+        };
+
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<>> heap;
+        std::vector<uint32_t> versions( vertices_num, 0 );
+        std::vector<bool> removed( vertices_num, false );
+
+        const auto push_edge = [&]( uint32_t a, uint32_t b ) {
+            auto q = quadrics[a];
+            q.add( quadrics[b] );
+            if ( !locked[a] ) {
+                heap.push( { q.error( positions[b] ), a, b, versions[a], versions[b] } );
+            }
+            if ( !locked[b] ) {
+                heap.push( { q.error( positions[a] ), b, a, versions[b], versions[a] } );
+            }
+        };
+
+        for ( const auto& [edge, count] : edges ) {
+            push_edge( static_cast<uint32_t>( edge >> 32 ), static_cast<uint32_t>( edge & 0xffffffffu ) );
+        }
+
+        const auto limit = double { max_error } * max_error;
+        auto remaining = triangles.size( );
+        double worst = 0.0;
+
+        // Wedge of from and the wedge of to it shares a triangle with, per collapse
+        std::vector<std::pair<uint32_t, uint32_t>> moves;
+        const auto corner = [&]( uint32_t t, uint32_t v ) {
+            const auto tri = triangles.data( ) + t * 3;
+            return t * 3 + static_cast<uint32_t>( std::find( tri, tri + 3, v ) - tri );
+        };
+        const auto moved = [&]( uint32_t wedge ) {
+            return std::find_if( moves.begin( ), moves.end( ), [&]( const auto& m ) { return m.first == wedge; } );
+        };
+
+        while ( remaining > target_indices && !heap.empty( ) ) {
+            const auto c = heap.top( );
+            heap.pop( );
+            if ( removed[c.from] || removed[c.to] || versions[c.from] != c.from_version
+                 || versions[c.to] != c.to_version )
+                continue;
+            if ( c.cost > limit )
+                break;
+
+            // Triangles that keep both vertices would flip or degenerate
+            const auto flips = std::any_of( around[c.from].begin( ), around[c.from].end( ), [&]( uint32_t t ) {
+                const auto tri = std::span { triangles }.subspan( t * 3, 3 );
+                if ( dead[t] || std::find( tri.begin( ), tri.end( ), c.to ) != tri.end( ) )
+                    return false;
+
+                const auto before = normal( t );
+                std::replace( tri.begin( ), tri.end( ), c.from, c.to );
+                const auto after = normal( t );
+                std::replace( tri.begin( ), tri.end( ), c.to, c.from );
+                return glm::dot( before, after ) <= 0.f;
+            } );
+            if ( flips )
+                continue;
+
+            // Every wedge of from moves to its counterpart across the collapsed edge, so the sides of a seam move
+            // together. A wedge without one would take the attributes of another side
+            moves.clear( );
+            for ( const auto t : around[c.from] ) {
+                const auto tri = std::span { triangles }.subspan( t * 3, 3 );
+                if ( !dead[t] && std::find( tri.begin( ), tri.end( ), c.to ) != tri.end( ) ) {
+                    moves.emplace_back( wedges[corner( t, c.from )], wedges[corner( t, c.to )] );
+                }
+            }
+            const auto tears = std::any_of( around[c.from].begin( ), around[c.from].end( ), [&]( uint32_t t ) {
+                return !dead[t] && moved( wedges[corner( t, c.from )] ) == moves.end( );
+            } );
+            if ( tears )
+                continue;
+
+            removed[c.from] = true;
+            quadrics[c.to].add( quadrics[c.from] );
+            versions[c.to]++;
+            worst = std::max( worst, c.cost );
+
+            for ( const auto t : around[c.from] ) {
+                if ( dead[t] )
+                    continue;
+
+                const auto tri = std::span { triangles }.subspan( t * 3, 3 );
+                if ( std::find( tri.begin( ), tri.end( ), c.to ) != tri.end( ) ) {
+                    dead[t] = true;
+                    remaining -= 3;
+                } else {
+                    const auto k = corner( t, c.from );
+                    wedges[k] = moved( wedges[k] )->second;
+                    triangles[k] = c.to;
+                    around[c.to].push_back( t );
+                }
+            }
+
+            for ( const auto t : around[c.to] ) {
+                for ( uint32_t k = 0; k < 3 && !dead[t]; k++ ) {
+                    if ( triangles[t * 3 + k] != c.to ) {
+                        push_edge( c.to, triangles[t * 3 + k] );
+                    }
+                }
+            }
+        }
+
+        out.clear( );
+        for ( uint32_t t = 0; t < dead.size( ); t++ ) {
+            if ( !dead[t] ) {
+                out.insert( out.end( ), wedges.begin( ) + t * 3, wedges.begin( ) + t * 3 + 3 );
+            }
+        }
+
+        return static_cast<float>( std::sqrt( std::max( worst, 0.0 ) ) );
+    }
+
+} // namespace detail
+
+// Appends coarser levels simplified from the full mesh to indices and returns their ranges, the full mesh first.
+// Errors are in the units read from the position attribute, so relative to the bounds for quantized formats
+inline auto build_lod_chain( VertexFormat format, byte_span vertices, std::vector<uint32_t>& indices,
+    const LodChainInfo& info = { } ) -> std::vector<GeometryLod> {
+    std::vector<GeometryLod> lods = { { 0, static_cast<uint32_t>( indices.size( ) ), 0.f } };
+
+    const auto positions = detail::read_positions( format, vertices );
+    if ( !detail::have_elements( format ) || positions.empty( ) || indices.size( ) % 3 != 0
+         || std::any_of( indices.begin( ), indices.end( ), [&]( uint32_t i ) { return i >= positions.size( ); } ) ) {
+        journal::warning( GRAPHICS_TAG, "Levels of detail need indexed triangles with a readable position" );
+        return lods;
+    }
+
+    vec3 lo { std::numeric_limits<float>::max( ) };
+    vec3 hi { std::numeric_limits<float>::lowest( ) };
+    for ( const auto i : indices ) {
+        lo = glm::min( lo, positions[i] );
+        hi = glm::max( hi, positions[i] );
+    }
+    const auto max_error = info.max_error * glm::length( hi - lo ) * 0.5f;
+
+    const std::vector<uint32_t> full( indices.begin( ), indices.end( ) );
+    std::vector<uint32_t> level;
+    auto target = full.size( );
+    while ( lods.size( ) < std::min( info.max_lods, MAX_GEOMETRY_LODS ) ) {
+        target = static_cast<size_t>( static_cast<float>( target / 3 ) * info.reduction ) * 3;
+        if ( target == 0 )
+            break;
+
+        const auto error = detail::simplify( full, positions, target, max_error, level );
+        if ( level.empty( ) || level.size( ) >= lods.back( ).num_elements )
+            break;
+
+        lods.push_back( { static_cast<uint32_t>( indices.size( ) ), static_cast<uint32_t>( level.size( ) ), error } );
+        indices.insert( indices.end( ), level.begin( ), level.end( ) );
+        target = level.size( );
+    }
+
+    if ( lods.size( ) == 1 && info.max_lods > 1 ) {
+        journal::warning( GRAPHICS_TAG, "No level of detail of {} triangles stays within the error limit",
+            full.size( ) / 3 );
+    }
+
+    return lods;
+}
+
+// Coarsest level whose error stays within max_pixels on screen. screen_scale is the viewport height over
+// 2 * tan( fovy / 2 ), distance the view distance of the geometry in the units of its vertices
+inline auto select_lod( const Geometry& g, float distance, float screen_scale, float max_pixels = 1.f ) noexcept
+    -> uint32_t {
+    uint32_t lod = 0;
+    for ( uint32_t i = 1; i < g.num_lods; i++ ) {
+        if ( g.lods[i].error * screen_scale > max_pixels * std::max( distance, 0.f ) )
+            break;
+        lod = i;
+    }
+    return lod;
+}
+
+// Draws only one level when recorded with draw_geometry, destroy the geometry itself rather than this copy
+inline auto lod_geometry( const Geometry& g, uint32_t lod ) noexcept -> Geometry {
+    if ( lod >= g.num_lods )
+        return g;
+
+    auto level = g;
+    level.first_index = g.lods[lod].first_index;
+    level.num_elements = g.lods[lod].num_elements;
+    return level;
+}
+
+namespace detail {
+
+    // The spans must hold info.vertices_num vertices and info.indices_num indices
+    inline auto is_geometry_data_valid( const CreateGeometryInfo& info, byte_span vertices, IndexSpan indices ) noexcept
+        -> bool {
+        const auto valid = vertices.size( ) >= info.vertices_num * vertex_size( info.format )
+                        && ( !have_elements( info.format ) || indices.size( ) >= info.indices_num );
+        if ( !valid ) {
+            journal::warning( GRAPHICS_TAG, "Geometry data is smaller than {} vertices and {} indices",
+                info.vertices_num, info.indices_num );
+        }
+        return valid;
+    }
+
+    template <typename To, typename From>
+    inline auto narrow_indices( const From* in, size_t count, std::byte* out ) noexcept -> bool {
+        for ( size_t i = 0; i < count; i++ ) {
+            if constexpr ( sizeof( From ) > sizeof( To ) ) {
+                if ( in[i] > std::numeric_limits<To>::max( ) )
+                    return false;
+            }
+
+            const auto index = static_cast<To>( in[i] );
+            memcpy( out + i * sizeof( To ), &index, sizeof( To ) );
+        }
+        return true;
+    }
+
+    // Validates the data and returns info.indices_num indices at type, converted into scratch when the widths differ
+    inline auto prepare_indices( const CreateGeometryInfo& info, byte_span vertices, IndexSpan indices,
+        IndexType type, std::vector<std::byte>& scratch ) noexcept -> std::optional<byte_span> {
+        if ( !is_geometry_data_valid( info, vertices, indices ) )
+            return std::nullopt;
+        if ( !have_elements( info.format ) )
+            return byte_span { };
+        if ( indices.type == type )
+            return indices.bytes.first( info.indices_num * index_size( type ) );
+
+        scratch.resize( info.indices_num * index_size( type ) );
+        const auto fits = visit_index_type( indices.type, [&]( auto from ) {
+            const auto in = reinterpret_cast<const decltype( from )*>( indices.bytes.data( ) );
+            return visit_index_type( type, [&]( auto to ) {
+                return narrow_indices<decltype( to )>( in, info.indices_num, scratch.data( ) );
+            } );
+        } );
+
+        if ( !fits ) {
+            journal::warning( GRAPHICS_TAG, "Geometry indices don't fit {} bit indices", index_size( type ) * 8 );
+            return std::nullopt;
+        }
+
+        return byte_span { scratch };
+    }
+
+    struct PreparedMesh {
+        CreateGeometryInfo info; // Counts of the prepared data, its vectors stay empty
+        std::vector<std::byte> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<GeometryLod> lods;
+        PositionQuantization quantization;
+    };
+
+    template <typename From, typename To>
+    auto quantize_mesh( PreparedMesh& mesh, VertexFormat format ) noexcept -> void {
+        std::vector<std::byte> out( mesh.info.vertices_num * sizeof( To ) );
+        const auto count = mesh.info.vertices_num;
+        const auto in = std::span { reinterpret_cast<const From*>( mesh.vertices.data( ) ), count };
+        mesh.quantization = quantize_vertices( in, std::span { reinterpret_cast<To*>( out.data( ) ), count } );
+        mesh.vertices = std::move( out );
+        mesh.info.format = format;
+    }
+
+    // Encodes the prepared vertices at the _q16 counterpart of their format, after simplification has used the
+    // full precision positions
+    inline auto quantize_mesh( PreparedMesh& mesh ) noexcept -> void {
+        switch ( mesh.info.format ) {
+        case VertexFormat::v3t2n3_f32ui16:
+            quantize_mesh<v3t2n3_t, v3t2n3_q16_t>( mesh, VertexFormat::v3t2n3_q16ui16 );
+            break;
+        case VertexFormat::v3uv2n3t3_f32ui16:
+            quantize_mesh<v3uv2n3t3_t, v3uv2n3t3_q16_t>( mesh, VertexFormat::v3uv2n3t3_q16ui16 );
+            break;
+        default:
+            journal::warning( GRAPHICS_TAG, "Vertex format {} has no quantized counterpart",
+                static_cast<uint32_t>( mesh.info.format ) );
+            break;
+        }
+    }
+
+    // Copies the mesh when it is optimized, gets levels of detail or is quantized and points the spans at the copy,
+    // returns the info describing the spans
+    inline auto prepare_mesh( const CreateGeometryInfo& info, byte_span& vertices, IndexSpan& indices,
+        PreparedMesh& mesh ) -> const CreateGeometryInfo& {
+        if ( ( !info.optimize && info.lods <= 1 && !info.quantize ) || !have_elements( info.format )
+             || !is_geometry_data_valid( info, vertices, indices ) )
+            return info;
+
+        mesh.vertices.assign( vertices.begin( ),
+            vertices.begin( ) + static_cast<std::ptrdiff_t>( info.vertices_num * vertex_size( info.format ) ) );
+        mesh.indices.resize( info.indices_num );
+        visit_index_type( indices.type, [&]( auto type ) {
+            const auto in = reinterpret_cast<const decltype( type )*>( indices.bytes.data( ) );
+            std::copy_n( in, info.indices_num, mesh.indices.begin( ) );
+        } );
+
+        if ( info.optimize ) {
+            optimize_mesh( info.format, mesh.vertices, mesh.indices );
+        }
+
+        if ( info.lods > 1 ) {
+            mesh.lods = build_lod_chain( info.format, mesh.vertices, mesh.indices, { .max_lods = info.lods } );
+            for ( size_t i = 1; i < mesh.lods.size( ) && info.optimize; i++ ) {
+                optimize_vertex_cache(
+                    std::span { mesh.indices }.subspan( mesh.lods[i].first_index, mesh.lods[i].num_elements ),
+                    info.vertices_num );
+            }
+        }
+
+        mesh.info.vertices_num = info.vertices_num;
+        mesh.info.indices_num = mesh.indices.size( );
+        mesh.info.min = info.min;
+        mesh.info.max = info.max;
+        mesh.info.format = info.format;
+
+        if ( info.quantize ) {
+            quantize_mesh( mesh );
+        }
+
+        vertices = mesh.vertices;
+        indices = IndexSpan { mesh.indices };
+        return mesh.info;
+    }
+
+    // Levels are offset by the first index of the geometry, the full mesh stays the default draw
+    inline auto apply_prepared_mesh( Geometry& g, const PreparedMesh& mesh ) noexcept -> void {
+        if ( !g.is_valid( ) )
+            return;
+
+        g.quantization = mesh.quantization;
+        if ( mesh.lods.size( ) < 2 )
+            return;
+
+        g.num_lods = static_cast<uint32_t>( std::min( mesh.lods.size( ), size_t { MAX_GEOMETRY_LODS } ) );
+        for ( uint32_t i = 0; i < g.num_lods; i++ ) {
+            g.lods[i] = mesh.lods[i];
+            g.lods[i].first_index += g.first_index;
+        }
+        g.num_elements = g.lods[0].num_elements;
+    }
+
+    // All indices owned by the geometry, including its levels of detail
+    inline auto geometry_index_range( const Geometry& g ) noexcept -> GeometryRange {
+        if ( g.num_lods == 0 )
+            return { g.first_index, g.num_elements };
+
+        const auto& last = g.lods[g.num_lods - 1];
+        return { g.lods[0].first_index, last.first_index + last.num_elements - g.lods[0].first_index };
+    }
+
+    // Indices are already at type, see prepare_indices. Buffers are left uninitialized when upload is false, the
+    // caller queues their contents
+    inline auto make_geometry( const CreateGeometryInfo& info, byte_span vertices, byte_span indices, IndexType type,
+        bool upload ) noexcept -> Geometry {
+        const auto indices_size = indices.size( );
+        const auto size = info.vertices_num * vertex_size( info.format ) + indices_size;
+        if ( !memory_tracker.reserve( MemoryCategory::geometry, size ) )
+            return { };
+
+        GLuint vbo = 0;
+        GLuint ebo = 0;
+        GLuint vao = 0;
+        uint32_t num_elements = 0;
+
+        if ( const auto size = vertex_size( info.format ); size == 0 ) {
+            journal::warning( GRAPHICS_TAG, "Unknown vertex format for buffer" );
+        } else {
+            glCreateBuffers( 1, &vbo );
+            glNamedBufferData(
+                vbo, info.vertices_num * size, upload ? vertices.data( ) : nullptr, GL_STATIC_DRAW );
+
+            if ( have_elements( info.format ) ) {
+                glCreateBuffers( 1, &ebo );
+                glNamedBufferData( ebo, indices_size, upload ? indices.data( ) : nullptr, GL_STATIC_DRAW );
+            }
+        }
+
+        glCreateVertexArrays( 1, &vao );
+        set_vertex_attributes( vao, info.format, vbo, ebo );
+        memory_tracker.track( MemoryCategory::geometry, vao, size );
+
+        if ( have_elements( info.format ) ) {
+            num_elements = static_cast<uint32_t>( info.indices_num );
+        } else if ( info.format == VertexFormat::v3_f32 ) {
+            num_elements = static_cast<uint32_t>( info.vertices_num );
+        }
+
+        // Contents are read back when the capture is written
+        capture_registry.record( CaptureResource::geometry, { vao, vbo, ebo }, [&]( auto& e ) {
+            e.info.write( CaptureGeometryInfo {
+                info.vertices_num, info.indices_num, info.min, info.max, info.format, type } );
+        } );
+
+        Geometry g;
+        g.vb = vbo;
+        g.eb = ebo;
+        g.vao = vao;
+        g.num_elements = num_elements;
+        g.format = info.format;
+        g.index_type = type;
+
+        return g;
+    }
+
+} // namespace detail
+
+// Reads the vertices and indices straight from the spans, info.vertices and info.indices are ignored
+inline auto create_geometry( const CreateGeometryInfo& info, byte_span vertices, IndexSpan indices ) noexcept
+    -> Geometry {
+    detail::PreparedMesh mesh;
+    const auto& mesh_info = detail::prepare_mesh( info, vertices, indices, mesh );
+
+    std::vector<std::byte> scratch;
+    const auto type = detail::select_index_type( mesh_info.vertices_num );
+    const auto index_data = detail::prepare_indices( mesh_info, vertices, indices, type, scratch );
+    if ( !index_data )
+        return { };
+
+    auto g = detail::make_geometry( mesh_info, vertices, *index_data, type, true );
+    detail::apply_prepared_mesh( g, mesh );
+    return g;
+}
+
+inline auto create_geometry( const CreateGeometryInfo& info ) noexcept -> Geometry {
+    return create_geometry( info, std::as_bytes( std::span { info.vertices } ), info.indices );
+}
+
+inline auto destroy_geometry( Geometry& geometry ) noexcept -> void {
+    if ( geometry.pooled ) {
+        journal::warning( GRAPHICS_TAG, "Pooled geometry must be destroyed through its pool" );
+        return;
+    }
+
+    detail::memory_tracker.release( MemoryCategory::geometry, geometry.vao );
+    detail::capture_registry.forget( CaptureResource::geometry, geometry.vao );
+    glDeleteBuffers( 1, &geometry.vb );
+    geometry.vb = 0;
+    glDeleteBuffers( 1, &geometry.eb );
+    geometry.eb = 0;
+    state_cache.forget_vertex_array( geometry.vao );
+    glDeleteVertexArrays( 1, &geometry.vao );
+    geometry.vao = 0;
+}
+
+namespace detail {
+
+    // First fit, the remainder of the chosen range stays free
+    inline auto allocate_range( std::vector<GeometryRange>& free, uint32_t count ) noexcept -> std::optional<uint32_t> {
+        for ( auto it = free.begin( ); it != free.end( ); ++it ) {
+            if ( it->count < count )
+                continue;
+
+            const auto offset = it->offset;
+            it->offset += count;
+            it->count -= count;
+            if ( it->count == 0 ) {
+                free.erase( it );
+            }
+            return offset;
+        }
+
+        return std::nullopt;
+    }
+
+    inline auto release_range( std::vector<GeometryRange>& free, GeometryRange range ) -> void {
+        if ( range.count == 0 )
+            return;
+
+        auto it = std::lower_bound( free.begin( ), free.end( ), range.offset,
+            []( const GeometryRange& r, uint32_t offset ) { return r.offset < offset; } );
+        it = free.insert( it, range );
+
+        if ( auto next = it + 1; next != free.end( ) && it->offset + it->count == next->offset ) {
+            it->count += next->count;
+            free.erase( next );
+        }
+
+        if ( it != free.begin( ) ) {
+            if ( auto prev = it - 1; prev->offset + prev->count == it->offset ) {
+                prev->count += it->count;
+                free.erase( it );
+            }
+        }
+    }
+
+    // Packs the given ranges to the front of the buffer through a scratch copy, GL forbids overlapping copies
+    inline auto compact_buffer( uint32_t buffer, uint32_t element_size, std::vector<GeometryRange*>& ranges )
+        -> uint32_t {
+        std::sort( ranges.begin( ), ranges.end( ),
+            []( const GeometryRange* a, const GeometryRange* b ) { return a->offset < b->offset; } );
+
+        uint32_t used = 0;
+        for ( const auto r : ranges ) {
+            used += r->count;
+        }
+
+        if ( used == 0 )
+            return 0;
+
+        uint32_t scratch = 0;
+        glCreateBuffers( 1, &scratch );
+        glNamedBufferData( scratch, GLsizeiptr { used } * element_size, nullptr, GL_STREAM_COPY );
+
+        uint32_t cursor = 0;
+        for ( const auto r : ranges ) {
+            glCopyNamedBufferSubData( buffer, scratch, GLintptr { r->offset } * element_size,
+                GLintptr { cursor } * element_size, GLsizeiptr { r->count } * element_size );
+            r->offset = cursor;
+            cursor += r->count;
+        }
+
+        glCopyNamedBufferSubData( scratch, buffer, 0, 0, GLsizeiptr { used } * element_size );
+        glDeleteBuffers( 1, &scratch );
+
+        return used;
+    }
+
+} // namespace detail
+
+inline auto create_geometry_pool( const CreateGeometryPoolInfo& info ) noexcept -> GeometryPool {
+    GeometryPool pool;
+    pool.format = info.format;
+    pool.index_type = info.index_type;
+    pool.vertex_capacity = info.vertex_capacity;
+    pool.index_capacity = detail::have_elements( info.format ) ? info.index_capacity : 0;
+
+    const auto vertex_size = detail::vertex_size( info.format );
+    if ( vertex_size == 0 ) {
+        journal::warning( GRAPHICS_TAG, "Unknown vertex format for geometry pool" );
+        return { };
+    }
+
+    const auto index_size = graphics::index_size( pool.index_type );
+    const auto size = size_t { pool.vertex_capacity } * vertex_size + size_t { pool.index_capacity } * index_size;
+    if ( !detail::memory_tracker.reserve( MemoryCategory::geometry, size ) )
+        return { };
+
+    glCreateBuffers( 1, &pool.vb );
+    glNamedBufferData( pool.vb, GLsizeiptr { pool.vertex_capacity } * vertex_size, nullptr, GL_STATIC_DRAW );
+    pool.free_vertices.push_back( { 0, pool.vertex_capacity } );
+
+    if ( pool.index_capacity > 0 ) {
+        glCreateBuffers( 1, &pool.eb );
+        glNamedBufferData( pool.eb, GLsizeiptr { pool.index_capacity } * index_size, nullptr, GL_STATIC_DRAW );
+        pool.free_indices.push_back( { 0, pool.index_capacity } );
+    }
+
+    glCreateVertexArrays( 1, &pool.vao );
+    detail::set_vertex_attributes( pool.vao, pool.format, pool.vb, pool.eb );
+    detail::memory_tracker.track( MemoryCategory::geometry, pool.vao, size );
+
+    // Allocated ranges are read back when the capture is written
+    detail::capture_registry.record( CaptureResource::geometry_pool, { pool.vao, pool.vb, pool.eb },
+        [&]( auto& e ) { e.info.write( info ); } );
+    detail::capture_registry.track_pool( pool );
+
+    return pool;
+}
+
+inline auto destroy_geometry_pool( GeometryPool& pool ) noexcept -> void {
+    if ( pool.num_geometries > 0 ) {
+        journal::warning( GRAPHICS_TAG, "Geometry pool {} destroyed with {} live geometries", pool.vao,
+            pool.num_geometries );
+    }
+
+    detail::memory_tracker.release( MemoryCategory::geometry, pool.vao );
+    detail::capture_registry.forget( CaptureResource::geometry_pool, pool.vao );
+    state_cache.forget_buffer( pool.vb );
+    state_cache.forget_buffer( pool.eb );
+    state_cache.forget_vertex_array( pool.vao );
+    glDeleteBuffers( 1, &pool.vb );
+    glDeleteBuffers( 1, &pool.eb );
+    glDeleteVertexArrays( 1, &pool.vao );
+    pool = { };
+}
+
+namespace detail {
+
+    // Reserves the mesh ranges, returns an invalid geometry when the pool is out of space
+    inline auto allocate_geometry( GeometryPool& pool, const CreateGeometryInfo& info ) noexcept -> Geometry {
+        if ( info.format != pool.format ) {
+            journal::warning( GRAPHICS_TAG, "Geometry format doesn't match pool {}", pool.vao );
+            return { };
+        }
+
+        const auto indexed = have_elements( pool.format );
+        const auto num_vertices = static_cast<uint32_t>( info.vertices_num );
+        const auto num_indices = indexed ? static_cast<uint32_t>( info.indices_num ) : 0u;
+
+        const auto base_vertex = allocate_range( pool.free_vertices, num_vertices );
+        const auto first_index = base_vertex ? allocate_range( pool.free_indices, num_indices ) : std::nullopt;
+        if ( !base_vertex || ( num_indices > 0 && !first_index ) ) {
+            if ( base_vertex ) {
+                release_range( pool.free_vertices, { *base_vertex, num_vertices } );
+            }
+
+            journal::warning( GRAPHICS_TAG, "Geometry pool {} is out of space for {} vertices and {} indices",
+                pool.vao, num_vertices, num_indices );
+            return { };
+        }
+
+        pool.num_geometries++;
+        capture_registry.track_pool( pool );
+
+        Geometry g;
+        g.vb = pool.vb;
+        g.eb = pool.eb;
+        g.vao = pool.vao;
+        g.format = pool.format;
+        g.index_type = pool.index_type;
+        g.num_elements = indexed ? num_indices : num_vertices;
+        g.base_vertex = *base_vertex;
+        g.first_index = num_indices > 0 ? *first_index : 0;
+        g.num_vertices = num_vertices;
+        g.pooled = true;
+
+        return g;
+    }
+
+} // namespace detail
+
+// Suballocates and uploads the mesh, returns an invalid geometry when the pool is out of space or the indices don't
+// fit the pool index type
+inline auto create_geometry( GeometryPool& pool, const CreateGeometryInfo& info, byte_span vertices,
+    IndexSpan indices ) noexcept -> Geometry {
+    detail::PreparedMesh mesh;
+    const auto& mesh_info = detail::prepare_mesh( info, vertices, indices, mesh );
+
+    std::vector<std::byte> scratch;
+    const auto index_data = detail::prepare_indices( mesh_info, vertices, indices, pool.index_type, scratch );
+    if ( !index_data )
+        return { };
+
+    auto g = detail::allocate_geometry( pool, mesh_info );
+    if ( !g.is_valid( ) )
+        return g;
+
+    detail::apply_prepared_mesh( g, mesh );
+
+    const auto vertex_size = detail::vertex_size( pool.format );
+    glNamedBufferSubData( pool.vb, GLintptr { g.base_vertex } * vertex_size,
+        GLsizeiptr { g.num_vertices } * vertex_size, vertices.data( ) );
+
+    if ( detail::have_elements( pool.format ) && g.num_elements > 0 ) {
+        glNamedBufferSubData( pool.eb, GLintptr { g.first_index } * index_size( pool.index_type ),
+            static_cast<GLsizeiptr>( index_data->size( ) ), index_data->data( ) );
+    }
+
+    return g;
+}
+
+inline auto create_geometry( GeometryPool& pool, const CreateGeometryInfo& info ) noexcept -> Geometry {
+    return create_geometry( pool, info, std::as_bytes( std::span { info.vertices } ), info.indices );
+}
+
+inline auto destroy_geometry( GeometryPool& pool, Geometry& geometry ) noexcept -> void {
+    if ( !geometry.pooled || geometry.vao != pool.vao ) {
+        journal::warning( GRAPHICS_TAG, "Geometry doesn't belong to pool {}", pool.vao );
+        return;
+    }
+
+    detail::release_range( pool.free_vertices, { geometry.base_vertex, geometry.num_vertices } );
+    if ( detail::have_elements( pool.format ) ) {
+        detail::release_range( pool.free_indices, detail::geometry_index_range( geometry ) );
+    }
+
+    pool.num_geometries--;
+    detail::capture_registry.track_pool( pool );
+    geometry = { };
+}
+
+// Moves every live geometry to the front of the pool and updates their ranges, so all of them must be passed
+inline auto defragment_geometry_pool( GeometryPool& pool, const std::vector<Geometry*>& geometries ) -> bool {
+    const auto owned = std::all_of( geometries.begin( ), geometries.end( ),
+        [&]( const Geometry* g ) { return g->pooled && g->vao == pool.vao; } );
+    if ( !owned || geometries.size( ) != pool.num_geometries ) {
+        journal::warning( GRAPHICS_TAG, "Defragmenting pool {} needs all of its {} geometries", pool.vao,
+            pool.num_geometries );
+        return false;
+    }
+
+    std::vector<GeometryRange> vertex_ranges;
+    std::vector<GeometryRange> index_ranges;
+    for ( const auto g : geometries ) {
+        vertex_ranges.push_back( { g->base_vertex, g->num_vertices } );
+        index_ranges.push_back( detail::have_elements( pool.format ) ? detail::geometry_index_range( *g )
+                                                                     : GeometryRange { g->first_index, 0 } );
+    }
+
+    std::vector<GeometryRange*> ranges;
+    for ( auto& r : vertex_ranges ) {
+        ranges.push_back( &r );
+    }
+    const auto used_vertices = detail::compact_buffer( pool.vb, detail::vertex_size( pool.format ), ranges );
+
+    ranges.clear( );
+    for ( auto& r : index_ranges ) {
+        ranges.push_back( &r );
+    }
+    const auto used_indices
+        = pool.eb != 0 ? detail::compact_buffer( pool.eb, index_size( pool.index_type ), ranges ) : 0;
+
+    for ( size_t i = 0; i < geometries.size( ); i++ ) {
+        auto& g = *geometries[i];
+        const auto moved = index_ranges[i].offset - detail::geometry_index_range( g ).offset;
+        g.base_vertex = vertex_ranges[i].offset;
+        g.first_index += moved;
+        for ( uint32_t l = 0; l < g.num_lods; l++ ) {
+            g.lods[l].first_index += moved;
+        }
+    }
+
+    pool.free_vertices.clear( );
+    detail::release_range( pool.free_vertices, { used_vertices, pool.vertex_capacity - used_vertices } );
+    pool.free_indices.clear( );
+    detail::release_range( pool.free_indices, { used_indices, pool.index_capacity - used_indices } );
+    detail::capture_registry.track_pool( pool );
+
+    return true;
+}
+
+///
+/// Uploads
+///
+inline auto create_upload_queue( const CreateUploadQueueInfo& info ) noexcept -> UploadQueue {
+    UploadQueue q;
+    q.staging = create_ring_buffer( { info.frame_budget, info.frames_in_flight } );
+
+    // Staging memory is never referenced by commands, so a capture doesn't need it
+    detail::capture_registry.forget( CaptureResource::buffer, q.staging.id );
+
+    return q;
+}
+
+inline auto destroy_upload_queue( UploadQueue& q ) noexcept {
+    if ( !q.pending.empty( ) ) {
+        journal::warning( GRAPHICS_TAG, "Upload queue destroyed with {} pending uploads", q.pending.size( ) );
+    }
+
+    for ( auto& f : q.in_flight ) {
+        if ( f.fence ) {
+            glDeleteSync( f.fence );
+        }
+    }
+
+    destroy_ring_buffer( q.staging );
+    q = { };
+}
+
+inline auto queue_upload( UploadQueue& q, PendingUpload&& upload ) -> UploadTicket {
+    upload.ticket = ++q.last_ticket;
+    q.pending_bytes += upload.data.size( );
+    q.pending.push_back( std::move( upload ) );
+    return q.last_ticket;
+}
+
+inline auto queue_upload( UploadQueue& q, const Buffer& b, size_t offset, const void* data, size_t size )
+    -> UploadTicket {
+    PendingUpload u;
+    u.id = b.id;
+    u.offset = offset;
+    u.data.resize( size );
+    memcpy( u.data.data( ), data, size );
+    return queue_upload( q, std::move( u ) );
+}
+
+// One layer of level 0, mipmaps are generated once the layer is copied
+inline auto queue_upload(
+    UploadQueue& q, const Texture& t, PixelFormat format, uint32_t layer, byte_span pixels, bool mipmaps )
+    -> UploadTicket {
+    auto internal_format = static_cast<GLint>( 0 );
+
+    PendingUpload u;
+    u.id = t.id;
+    u.target = t.target;
+    u.offset = layer;
+    u.width = t.width;
+    u.height = t.height;
+    u.mipmaps = mipmaps;
+    detail::get_texture_format_from_pixelformat( format, internal_format, u.format, u.type );
+    u.data.resize( pixels.size( ) );
+    memcpy( u.data.data( ), pixels.data( ), pixels.size( ) );
+    return queue_upload( q, std::move( u ) );
+}
+
+namespace detail {
+
+    inline auto copy_texture_layer( const PendingUpload& u, const void* pixels ) noexcept -> void {
+        const auto w = static_cast<GLsizei>( u.width );
+        const auto h = static_cast<GLsizei>( u.height );
+        if ( u.target == GL_TEXTURE_2D ) {
+            glTextureSubImage2D( u.id, 0, 0, 0, w, h, u.format, u.type, pixels );
+        } else {
+            glTextureSubImage3D(
+                u.id, 0, 0, 0, static_cast<GLint>( u.offset ), w, h, 1, u.format, u.type, pixels );
+        }
+    }
+
+    // Deletes the fences of finished flushes in order, stops at the first one still running or past ticket
+    inline auto retire_uploads( UploadQueue& q, UploadTicket ticket ) noexcept -> void {
+        while ( !q.in_flight.empty( ) && q.completed < ticket ) {
+            auto& f = q.in_flight.front( );
+            if ( f.fence ) {
+                const auto status = glClientWaitSync( f.fence, 0, 0 );
+                if ( status == GL_TIMEOUT_EXPIRED )
+                    break;
+
+                glDeleteSync( f.fence );
+            }
+
+            q.completed = f.ticket;
+            q.in_flight.pop_front( );
+        }
+    }
+
+} // namespace detail
+
+// Stages pending uploads into the next ring segment and issues their copies, returns the bytes staged.
+// Call once per frame on the thread owning the context, draws submitted afterwards see the copied data.
+inline auto flush_uploads( UploadQueue& q ) noexcept -> size_t {
+    // Fences are polled here too, so queues nobody asks about don't keep one per flush
+    detail::retire_uploads( q, std::numeric_limits<UploadTicket>::max( ) );
+
+    if ( q.pending.empty( ) || !q.staging.mapped )
+        return 0;
+
+    auto& staging = q.staging;
+    begin_ring_frame( staging );
+
+    size_t staged = 0;
+    UploadTicket last = 0;
+    bool unpack_bound = false;
+
+    while ( !q.pending.empty( ) ) {
+        auto& u = q.pending.front( );
+        const auto left = u.data.size( ) - u.staged;
+        const auto space = size_t { staging.segment_size - staging.head };
+
+        if ( u.target == 0 ) {
+            const auto size = std::min( left, space );
+            if ( size > 0 ) {
+                const auto a = upload_ring_buffer( staging, u.data.data( ) + u.staged, size );
+                glCopyNamedBufferSubData(
+                    staging.id, u.id, a.offset, static_cast<GLintptr>( u.offset + u.staged ), a.size );
+            }
+
+            u.staged += size;
+            staged += size;
+            if ( u.staged < u.data.size( ) )
+                break;
+        } else if ( left > staging.segment_size ) {
+            journal::warning( GRAPHICS_TAG, "Texture {} layer of {} bytes exceeds the upload budget, copied directly",
+                u.id, left );
+
+            if ( unpack_bound ) {
+                glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+                unpack_bound = false;
+            }
+            detail::copy_texture_layer( u, u.data.data( ) );
+        } else if ( left > space ) {
+            break;
+        } else {
+            if ( !unpack_bound ) {
+                glBindBuffer( GL_PIXEL_UNPACK_BUFFER, staging.id );
+                unpack_bound = true;
+            }
+
+            // With a pixel unpack buffer bound the pointer is an offset into it
+            const auto a = upload_ring_buffer( staging, u.data.data( ), left );
+            detail::copy_texture_layer( u, reinterpret_cast<const void*>( uintptr_t { a.offset } ) );
+            staged += left;
+        }
+
+        if ( u.mipmaps ) {
+            glGenerateTextureMipmap( u.id );
+        }
+
+        q.pending_bytes -= u.data.size( );
+        last = u.ticket;
+        q.pending.pop_front( );
+    }
+
+    if ( unpack_bound ) {
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    }
+
+    end_ring_frame( staging );
+
+    if ( last != 0 ) {
+        q.in_flight.push_back( { glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 ), last } );
+    }
+
+    return staged;
+}
+
+// True once the GPU finished the copies of the upload, polls the fences without blocking
+inline auto is_upload_complete( UploadQueue& q, UploadTicket ticket ) noexcept -> bool {
+    detail::retire_uploads( q, ticket );
+    return ticket <= q.completed;
+}
+
+inline auto create_buffer( UploadQueue& q, const CreateBufferInfo& info ) noexcept -> Buffer {
+    const auto b = create_buffer( { nullptr, info.size, info.usage } );
+    if ( b.is_valid( ) && info.data ) {
+        queue_upload( q, b, 0, info.data, info.size );
+    }
+    return b;
+}
+
+// Allocates the storage now and queues the pixels, mipmaps are generated when they are copied
+inline auto create_texture( UploadQueue& q, const CreateTextureInfo& info, byte_span pixels ) noexcept -> Texture {
+    if ( !detail::is_pixel_data_valid( info.format, info.width, info.height, { &pixels, 1 } ) )
+        return { };
+
+    const auto id = detail::create_texture_storage( GL_TEXTURE_2D, info );
+    if ( id == 0 )
+        return { };
+
+    detail::capture_registry.record( CaptureResource::texture, { id }, [&]( auto& e ) {
+        detail::capture_texture( e, GL_TEXTURE_2D, info );
+        detail::capture_layers( e, { pixels } );
+    } );
+
+    const Texture t { id, GL_TEXTURE_2D, info.width, info.height, 0, info.format, info.levels };
+    if ( !pixels.empty( ) ) {
+        queue_upload( q, t, info.format, 0, pixels, info.mipmaps );
+    }
+    return t;
+}
+
+inline auto create_texture( UploadQueue& q, const CreateTextureInfo& info ) noexcept -> Texture {
+    return create_texture( q, info, std::as_bytes( std::span { info.pixels } ) );
+}
+
+inline auto create_texture_array(
+    UploadQueue& q, const CreateTextureArrayInfo& info, const std::vector<byte_span>& layers ) noexcept -> Texture {
+    if ( !detail::is_pixel_data_valid( info.format, info.width, info.height, layers ) )
+        return { };
+
+    const auto id = detail::create_texture_storage( GL_TEXTURE_2D_ARRAY, info );
+    if ( id == 0 )
+        return { };
+
+    detail::capture_registry.record( CaptureResource::texture, { id }, [&]( auto& e ) {
+        detail::capture_texture( e, GL_TEXTURE_2D_ARRAY, info );
+        detail::capture_layers( e, layers );
+    } );
+
+    // Mipmaps are generated after the last layer that has pixels
+    const auto with_pixels
+        = std::find_if( layers.rbegin( ), layers.rend( ), []( const auto& p ) { return !p.empty( ); } );
+    const auto last = static_cast<size_t>( with_pixels.base( ) - layers.begin( ) );
+
+    const Texture t { id, GL_TEXTURE_2D_ARRAY, info.width, info.height, info.depth, info.format, info.levels };
+    for ( uint32_t i = 0; i < std::min( size_t { info.depth }, layers.size( ) ); i++ ) {
+        if ( !layers[i].empty( ) ) {
+            queue_upload( q, t, info.format, i, layers[i], info.mipmaps && i + 1 == last );
+        }
+    }
+    return t;
+}
+
+inline auto create_texture_array( UploadQueue& q, const CreateTextureArrayInfo& info ) noexcept -> Texture {
+    return create_texture_array( q, info, detail::layer_spans( info.pixels ) );
+}
+
+inline auto create_geometry( UploadQueue& q, const CreateGeometryInfo& info, byte_span vertices,
+    IndexSpan indices ) noexcept -> Geometry {
+    detail::PreparedMesh mesh;
+    const auto& mesh_info = detail::prepare_mesh( info, vertices, indices, mesh );
+
+    std::vector<std::byte> scratch;
+    const auto type = detail::select_index_type( mesh_info.vertices_num );
+    const auto index_data = detail::prepare_indices( mesh_info, vertices, indices, type, scratch );
+    if ( !index_data )
+        return { };
+
+    auto g = detail::make_geometry( mesh_info, vertices, *index_data, type, false );
+    detail::apply_prepared_mesh( g, mesh );
+    if ( g.vb != 0 ) {
+        queue_upload( q, { g.vb }, 0, vertices.data( ), mesh_info.vertices_num * detail::vertex_size( g.format ) );
+    }
+    if ( g.eb != 0 ) {
+        queue_upload( q, { g.eb }, 0, index_data->data( ), index_data->size( ) );
+    }
+    return g;
+}
+
+inline auto create_geometry( UploadQueue& q, const CreateGeometryInfo& info ) noexcept -> Geometry {
+    return create_geometry( q, info, std::as_bytes( std::span { info.vertices } ), info.indices );
+}
+
+inline auto create_geometry( GeometryPool& pool, UploadQueue& q, const CreateGeometryInfo& info, byte_span vertices,
+    IndexSpan indices ) noexcept -> Geometry {
+    detail::PreparedMesh mesh;
+    const auto& mesh_info = detail::prepare_mesh( info, vertices, indices, mesh );
+
+    std::vector<std::byte> scratch;
+    const auto index_data = detail::prepare_indices( mesh_info, vertices, indices, pool.index_type, scratch );
+    if ( !index_data )
+        return { };
+
+    auto g = detail::allocate_geometry( pool, mesh_info );
+    if ( !g.is_valid( ) )
+        return g;
+
+    detail::apply_prepared_mesh( g, mesh );
+
+    const auto vertex_size = detail::vertex_size( pool.format );
+    queue_upload( q, { pool.vb }, size_t { g.base_vertex } * vertex_size, vertices.data( ),
+        size_t { g.num_vertices } * vertex_size );
+
+    if ( detail::have_elements( pool.format ) && g.num_elements > 0 ) {
+        queue_upload( q, { pool.eb }, size_t { g.first_index } * index_size( pool.index_type ), index_data->data( ),
+            index_data->size( ) );
+    }
+
+    return g;
+}
+
+inline auto create_geometry( GeometryPool& pool, UploadQueue& q, const CreateGeometryInfo& info ) noexcept
+    -> Geometry {
+    return create_geometry( pool, q, info, std::as_bytes( std::span { info.vertices } ), info.indices );
+}
+
+///
+/// Deferred destruction
+///
+inline auto create_deletion_queue( const CreateDeletionQueueInfo& info ) noexcept -> DeletionQueue {
+    DeletionQueue q;
+    q.frames_in_flight = info.frames_in_flight;
+    q.max_recycled = info.max_recycled;
+    return q;
+}
+
+inline auto destroy_buffer( DeletionQueue& q, Buffer& b ) -> void {
+    if ( b.is_valid( ) ) {
+        q.current.buffers.push_back( std::move( b ) );
+    }
+    b = { };
+}
+
+inline auto destroy_texture( DeletionQueue& q, Texture& t ) -> void {
+    if ( t.is_valid( ) ) {
+        q.current.textures.push_back( t );
+    }
+    t = { };
+}
+
+inline auto destroy_geometry( DeletionQueue& q, Geometry& g ) -> void {
+    if ( g.pooled ) {
+        journal::warning( GRAPHICS_TAG, "Pooled geometry must be destroyed through its pool" );
+        return;
+    }
+
+    if ( g.is_valid( ) ) {
+        q.current.geometries.push_back( g );
+    }
+    g = { };
+}
+
+namespace detail {
+
+    inline auto free_buffer_key( size_t size, BufferUsage usage ) noexcept -> uint64_t {
+        return uint64_t { size } << 2 | static_cast<uint64_t>( usage );
+    }
+
+    inline auto release_retired( DeletionQueue& q, RetiredFrame& f ) -> void {
+        for ( auto& b : f.buffers ) {
+            auto& free = q.free_buffers[free_buffer_key( b.size, b.usage )];
+            if ( free.size( ) < q.max_recycled ) {
+                free.push_back( std::move( b ) );
+            } else {
+                destroy_buffer( b );
+            }
+        }
+
+        for ( auto& t : f.textures ) {
+            if ( q.free_textures.size( ) < q.max_recycled && t.target == GL_TEXTURE_2D ) {
+                q.free_textures.push_back( t );
+            } else {
+                destroy_texture( t );
+            }
+        }
+
+        for ( auto& g : f.geometries ) {
+            destroy_geometry( g );
+        }
+    }
+
+} // namespace detail
+
+// Fences the objects destroyed this frame and releases those the GPU is done with, call once per frame after present
+inline auto end_deletion_frame( DeletionQueue& q ) -> void {
+    q.frame++;
+
+    if ( !q.current.empty( ) ) {
+        q.current.fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+        q.current.frame = q.frame;
+        q.frames.push_back( std::move( q.current ) );
+        q.current = { };
+    }
+
+    while ( !q.frames.empty( ) ) {
+        auto& f = q.frames.front( );
+        if ( q.frame - f.frame < q.frames_in_flight )
+            break;
+
+        if ( f.fence ) {
+            if ( glClientWaitSync( f.fence, 0, 0 ) == GL_TIMEOUT_EXPIRED )
+                break;
+
+            glDeleteSync( f.fence );
+        }
+
+        detail::release_retired( q, f );
+        q.frames.pop_front( );
+    }
+}
+
+// Waits for every retired frame and deletes all objects, free lists included
+inline auto destroy_deletion_queue( DeletionQueue& q ) -> void {
+    if ( !q.current.empty( ) ) {
+        q.current.fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+        q.frames.push_back( std::move( q.current ) );
+    }
+    q.max_recycled = 0;
+
+    for ( auto& f : q.frames ) {
+        if ( f.fence ) {
+            detail::wait_sync( f.fence );
+            glDeleteSync( f.fence );
+        }
+        detail::release_retired( q, f );
+    }
+
+    for ( auto& [key, free] : q.free_buffers ) {
+        for ( auto& b : free ) {
+            destroy_buffer( b );
+        }
+    }
+    for ( auto& t : q.free_textures ) {
+        destroy_texture( t );
+    }
+
+    q = { };
+}
+
+// Reuses a free buffer of the same size and usage when there is one
+inline auto create_buffer( DeletionQueue& q, const CreateBufferInfo& info ) noexcept -> Buffer {
+    const auto it = q.free_buffers.find( detail::free_buffer_key( info.size, info.usage ) );
+    if ( it == q.free_buffers.end( ) || it->second.empty( ) )
+        return create_buffer( info );
+
+    auto b = std::move( it->second.back( ) );
+    it->second.pop_back( );
+    q.recycled++;
+
+    b.dirty.clear( );
+    if ( info.data ) {
+        glNamedBufferSubData( b.id, 0, static_cast<GLsizeiptr>( info.size ), info.data );
+    }
+
+    return b;
+}
+
+// Reuses a free 2D texture with the same size, format and levels when there is one
+inline auto create_texture( DeletionQueue& q, const CreateTextureInfo& info, byte_span pixels ) noexcept -> Texture {
+    if ( !detail::is_pixel_data_valid( info.format, info.width, info.height, { &pixels, 1 } ) )
+        return { };
+
+    const auto it = std::find_if( q.free_textures.begin( ), q.free_textures.end( ), [&]( const Texture& t ) {
+        return t.width == info.width && t.height == info.height && t.format == info.format
+            && t.levels == info.levels;
+    } );
+    if ( it == q.free_textures.end( ) )
+        return create_texture( info, pixels );
+
+    const auto t = *it;
+    q.free_textures.erase( it );
+    q.recycled++;
+
+    // The capture entry is replaced, it describes the previous owner
+    detail::capture_registry.forget( CaptureResource::texture, t.id );
+    detail::apply_texture_fitering( t.id, info.filter, info.levels );
+    detail::fill_texture( t.id, info, pixels );
+
+    return t;
+}
+
+inline auto create_texture( DeletionQueue& q, const CreateTextureInfo& info ) noexcept -> Texture {
+    return create_texture( q, info, std::as_bytes( std::span { info.pixels } ) );
+}
+
+///
+/// Transient buffers
+///
+constexpr size_t MIN_TRANSIENT_BUFFER_SIZE = 256;
+
+inline auto create_transient_buffer_pool( const CreateTransientBufferPoolInfo& info ) noexcept -> TransientBufferPool {
+    return { create_deletion_queue( { info.frames_in_flight, info.max_free } ), { } };
+}
+
+inline auto destroy_transient_buffer_pool( TransientBufferPool& pool ) -> void {
+    destroy_deletion_queue( pool.retired );
+    pool = { };
+}
+
+// The buffer size is the size class, so it may be larger than requested
+inline auto acquire_transient_buffer( TransientBufferPool& pool, size_t size, BufferUsage usage = BufferUsage::Stream )
+    -> Buffer {
+    const auto size_class = std::bit_ceil( std::max( size, MIN_TRANSIENT_BUFFER_SIZE ) );
+    const auto recycled = pool.retired.recycled;
+    auto b = create_buffer( pool.retired, { nullptr, size_class, usage } );
+
+    pool.stats.requests++;
+    if ( pool.retired.recycled != recycled ) {
+        pool.stats.hits++;
+    }
+
+    return b;
+}
+
+// The buffer may still be read by frames in flight, it is handed out again once their fence signals
+inline auto release_transient_buffer( TransientBufferPool& pool, Buffer& b ) -> void {
+    destroy_buffer( pool.retired, b );
+}
+
+// Call once per frame after present
+inline auto end_transient_frame( TransientBufferPool& pool ) -> void {
+    end_deletion_frame( pool.retired );
+}
+
+///
+/// Frame pacing
+///
+inline auto create_frame_limiter( const CreateFrameLimiterInfo& info ) noexcept -> FrameLimiter {
+    FrameLimiter l;
+    l.max_frames = std::clamp( info.max_frames, 1u, MAX_FRAMES_IN_FLIGHT );
+    return l;
+}
+
+inline auto destroy_frame_limiter( FrameLimiter& l ) noexcept -> void {
+    for ( auto& f : l.fences ) {
+        if ( f ) {
+            glDeleteSync( f );
+        }
+    }
+    l.fences = { }; // Stats stay readable
+}
+
+// Call at the start of every present, fences the previous frame and waits until at most max_frames are in flight
+inline auto limit_frames_in_flight( FrameLimiter& l ) noexcept -> void {
+    using namespace std::chrono;
+
+    l.fences[l.frame % l.max_frames] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    l.frame++;
+    l.stats.frames++;
+    l.stats.last_wait = nanoseconds { 0 };
+
+    auto& fence = l.fences[l.frame % l.max_frames];
+    if ( !fence )
+        return;
+
+    if ( glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0 ) == GL_TIMEOUT_EXPIRED ) {
+        const auto start = steady_clock::now( );
+        if ( detail::wait_sync( fence ) == GL_WAIT_FAILED ) {
+            journal::warning( GRAPHICS_TAG, "Frame limiter fence wait failed" );
+        }
+
+        l.stats.last_wait = duration_cast<nanoseconds>( steady_clock::now( ) - start );
+        l.stats.total_wait += l.stats.last_wait;
+        l.stats.worst_wait = std::max( l.stats.worst_wait, l.stats.last_wait );
+        l.stats.stalls++;
+    }
+
+    glDeleteSync( fence );
+    fence = nullptr;
+}
+
+///
+/// Backends
+///
+enum class Backend {
+    opengl, // Function pointers loaded by glad
+    null, // Every call is a no-op
+    counting // No-op, every call is counted per function
+};
+
+// Every GL function called by this header, the null backends replace exactly these
+#define GRAPHICS_GL_FUNCTIONS( X ) \
+    X( glBindBuffer ) \
+    X( glBindBufferRange ) \
+    X( glBindFramebuffer ) \
+    X( glBindProgramPipeline ) \
+    X( glBindTextureUnit ) \
+    X( glBindVertexArray ) \
+    X( glBlendFunc ) \
+    X( glBlitNamedFramebuffer ) \
+    X( glCheckNamedFramebufferStatus ) \
+    X( glClearNamedFramebufferfv ) \
+    X( glClientWaitSync ) \
+    X( glClipControl ) \
+    X( glCopyNamedBufferSubData ) \
+    X( glCreateBuffers ) \
+    X( glCreateFramebuffers ) \
+    X( glCreateProgramPipelines ) \
+    X( glCreateRenderbuffers ) \
+    X( glCreateShaderProgramv ) \
+    X( glCreateTextures ) \
+    X( glCreateVertexArrays ) \
+    X( glCullFace ) \
+    X( glDeleteBuffers ) \
+    X( glDeleteFramebuffers ) \
+    X( glDeleteProgram ) \
+    X( glDeleteProgramPipelines ) \
+    X( glDeleteRenderbuffers ) \
+    X( glDeleteSync ) \
+    X( glDeleteTextures ) \
+    X( glDeleteVertexArrays ) \
+    X( glDepthFunc ) \
+    X( glDepthMask ) \
+    X( glDisable ) \
+    X( glDrawArrays ) \
+    X( glDrawArraysInstanced ) \
+    X( glDrawArraysInstancedBaseInstance ) \
+    X( glDrawElementsBaseVertex ) \
+    X( glDrawElementsInstancedBaseVertex ) \
+    X( glDrawElementsInstancedBaseVertexBaseInstance ) \
+    X( glEnable ) \
+    X( glEnableVertexArrayAttrib ) \
+    X( glFenceSync ) \
+    X( glFlushMappedNamedBufferRange ) \
+    X( glGenerateTextureMipmap ) \
+    X( glGetIntegerv ) \
+    X( glGetNamedBufferSubData ) \
+    X( glGetProgramInfoLog ) \
+    X( glGetProgramInterfaceiv ) \
+    X( glGetProgramResourceName ) \
+    X( glGetProgramResourceiv ) \
+    X( glGetProgramiv ) \
+    X( glGetTextureSubImage ) \
+    X( glMapNamedBufferRange ) \
+    X( glMultiDrawElementsIndirect ) \
+    X( glNamedBufferData ) \
+    X( glNamedBufferStorage ) \
+    X( glNamedBufferSubData ) \
+    X( glNamedFramebufferRenderbuffer ) \
+    X( glNamedFramebufferTexture ) \
+    X( glNamedRenderbufferStorage ) \
+    X( glNamedRenderbufferStorageMultisample ) \
+    X( glPixelStorei ) \
+    X( glProgramUniform1fv ) \
+    X( glProgramUniform1iv ) \
+    X( glProgramUniform2fv ) \
+    X( glProgramUniform3fv ) \
+    X( glProgramUniform4fv ) \
+    X( glProgramUniformMatrix4fv ) \
+    X( glTextureParameterf ) \
+    X( glTextureParameteri ) \
+    X( glTextureStorage2D ) \
+    X( glTextureStorage3D ) \
+    X( glTextureSubImage2D ) \
+    X( glTextureSubImage3D ) \
+    X( glUnmapNamedBuffer ) \
+    X( glUseProgramStages ) \
+    X( glVertexArrayAttribBinding ) \
+    X( glVertexArrayAttribFormat ) \
+    X( glVertexArrayElementBuffer ) \
+    X( glVertexArrayVertexBuffer ) \
+    X( glViewportIndexedfv )
+
+struct BackendCallCount {
+    std::string_view name;
+    uint64_t count = 0;
+};
+
+namespace detail {
+
+    enum class GLFunction : uint32_t {
+#define GRAPHICS_GL_ENUM( name ) fn_##name,
+        GRAPHICS_GL_FUNCTIONS( GRAPHICS_GL_ENUM )
+#undef GRAPHICS_GL_ENUM
+            count
+    };
+
+    constexpr std::string_view gl_function_names[] = {
+#define GRAPHICS_GL_NAME( name ) #name,
+        GRAPHICS_GL_FUNCTIONS( GRAPHICS_GL_NAME )
+#undef GRAPHICS_GL_NAME
+    };
+
+    struct GLFunctionTable {
+#define GRAPHICS_GL_POINTER( name ) decltype( glad_##name ) fn_##name = nullptr;
+        GRAPHICS_GL_FUNCTIONS( GRAPHICS_GL_POINTER )
+#undef GRAPHICS_GL_POINTER
+    };
+
+    struct NullBackendState {
+        Backend active = Backend::opengl;
+        GLFunctionTable saved;
+        std::array<uint64_t, static_cast<size_t>( GLFunction::count )> counts = { };
+        uint32_t next_id = 1;
+        std::unordered_map<GLuint, std::vector<std::byte>> mapped; // Stays valid while mapped persistently
+    };
+
+    inline NullBackendState null_backend;
+
+    inline auto count_call( GLFunction f ) noexcept -> void {
+        if ( null_backend.active == Backend::counting ) {
+            null_backend.counts[static_cast<size_t>( f )]++;
+        }
+    }
+
+    template <GLFunction F, typename Fn> struct NullFunction;
+
+    template <GLFunction F, typename R, typename... Args> struct NullFunction<F, R( APIENTRYP )( Args... )> {
+        static auto APIENTRY call( Args... ) -> R {
+            count_call( F );
+            if constexpr ( !std::is_void_v<R> ) {
+                return R { };
+            }
+        }
+    };
+
+    inline auto null_create( GLsizei n, GLuint* ids ) noexcept -> void {
+        for ( GLsizei i = 0; i < n; i++ ) {
+            ids[i] = null_backend.next_id++;
+        }
+    }
+
+    // Calls that hand out objects or memory must produce something usable
+    inline auto install_null_overrides( ) -> void {
+        glad_glCreateBuffers = []( GLsizei n, GLuint* ids ) {
+            count_call( GLFunction::fn_glCreateBuffers );
+            null_create( n, ids );
+        };
+        glad_glCreateVertexArrays = []( GLsizei n, GLuint* ids ) {
+            count_call( GLFunction::fn_glCreateVertexArrays );
+            null_create( n, ids );
+        };
+        glad_glCreateFramebuffers = []( GLsizei n, GLuint* ids ) {
+            count_call( GLFunction::fn_glCreateFramebuffers );
+            null_create( n, ids );
+        };
+        glad_glCreateRenderbuffers = []( GLsizei n, GLuint* ids ) {
+            count_call( GLFunction::fn_glCreateRenderbuffers );
+            null_create( n, ids );
+        };
+        glad_glCreateProgramPipelines = []( GLsizei n, GLuint* ids ) {
+            count_call( GLFunction::fn_glCreateProgramPipelines );
+            null_create( n, ids );
+        };
+        glad_glCreateTextures = []( GLenum, GLsizei n, GLuint* ids ) {
+            count_call( GLFunction::fn_glCreateTextures );
+            null_create( n, ids );
+        };
+        glad_glCreateShaderProgramv = []( GLenum, GLsizei, const GLchar* const* ) -> GLuint {
+            count_call( GLFunction::fn_glCreateShaderProgramv );
+            return null_backend.next_id++;
+        };
+        glad_glCheckNamedFramebufferStatus = []( GLuint, GLenum ) -> GLenum {
+            count_call( GLFunction::fn_glCheckNamedFramebufferStatus );
+            return GL_FRAMEBUFFER_COMPLETE;
+        };
+        glad_glMapNamedBufferRange = []( GLuint id, GLintptr, GLsizeiptr length, GLbitfield ) -> void* {
+            count_call( GLFunction::fn_glMapNamedBufferRange );
+            auto& mapped = null_backend.mapped[id];
+            if ( mapped.size( ) < static_cast<size_t>( length ) ) {
+                mapped.resize( static_cast<size_t>( length ) );
+            }
+            return mapped.data( );
+        };
+    }
+
+} // namespace detail
+
+// Switches the glad function pointers, the real ones are restored when switching back to Backend::opengl
+inline auto set_backend( Backend backend ) -> void {
+    using namespace detail;
+
+    if ( null_backend.active == backend )
+        return;
+
+    if ( null_backend.active == Backend::opengl ) {
+#define GRAPHICS_GL_SAVE( name ) null_backend.saved.fn_##name = glad_##name;
+        GRAPHICS_GL_FUNCTIONS( GRAPHICS_GL_SAVE )
+#undef GRAPHICS_GL_SAVE
+    }
+
+    if ( backend == Backend::opengl ) {
+#define GRAPHICS_GL_RESTORE( name ) glad_##name = null_backend.saved.fn_##name;
+        GRAPHICS_GL_FUNCTIONS( GRAPHICS_GL_RESTORE )
+#undef GRAPHICS_GL_RESTORE
+    } else if ( null_backend.active == Backend::opengl ) {
+#define GRAPHICS_GL_NULL( name ) glad_##name = &NullFunction<GLFunction::fn_##name, decltype( glad_##name )>::call;
+        GRAPHICS_GL_FUNCTIONS( GRAPHICS_GL_NULL )
+#undef GRAPHICS_GL_NULL
+        install_null_overrides( );
+    }
+
+    null_backend.active = backend;
+    state_cache.invalidate( );
+}
+
+inline auto reset_backend_counts( ) noexcept -> void {
+    detail::null_backend.counts = { };
+}
+
+// Calls made since the last reset, sorted by count, only recorded by Backend::counting
+inline auto backend_call_counts( ) -> std::vector<BackendCallCount> {
+    std::vector<BackendCallCount> counts;
+    for ( size_t i = 0; i < detail::null_backend.counts.size( ); i++ ) {
+        if ( detail::null_backend.counts[i] > 0 ) {
+            counts.push_back( { detail::gl_function_names[i], detail::null_backend.counts[i] } );
+        }
+    }
+
+    std::sort( counts.begin( ), counts.end( ), []( const auto& a, const auto& b ) { return a.count > b.count; } );
+    return counts;
+}
+
+///
+/// Capture files
+///
+constexpr uint32_t CAPTURE_MAGIC = 0x43584647; // "GFXC"
+constexpr uint32_t CAPTURE_VERSION = 3;
+
+// Resources and queues created from a capture file, the queues are kept between presents
+struct Capture {
+    uint32_t width = 0; // Default framebuffer size of the captured frame
+    uint32_t height = 0;
+
+    std::vector<CommandQueue> queues;
+    CommandQueues pointers;
+
+    std::vector<Texture> textures;
+    std::vector<Renderbuffer> renderbuffers;
+    std::vector<Framebuffer> framebuffers;
+    std::vector<Shader> shaders;
+    std::vector<ProgramPipeline> pipelines;
+    std::vector<Buffer> buffers;
+    std::vector<Geometry> geometries;
+    std::vector<GeometryPool> geometry_pools;
+};
+
+namespace detail {
+
+    struct CaptureHeader {
+        uint32_t magic = CAPTURE_MAGIC;
+        uint32_t version = CAPTURE_VERSION;
+        uint32_t layout = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t num_resources = 0;
+        uint32_t num_queues = 0;
+    };
+
+    struct CaptureQueueInfo {
+        bool sorted = false;
+        bool coalesce_draws = false;
+        ColorBlendState color_blend;
+        RasterizerState rasterizer;
+        DepthStencilState depth_stencil;
+        uint32_t num_commands = 0;
+        uint32_t size_bytes = 0;
+    };
+
+    // Payload size of every alternative as encoded by CommandStream
+    template <typename V> struct record_sizes;
+
+    template <typename... Ts> struct record_sizes<std::variant<Ts...>> {
+        static constexpr std::array<uint32_t, sizeof...( Ts )> value = { static_cast<uint32_t>(
+            std::is_same_v<Ts, SetUniformCommand> ? sizeof( UniformRecord ) : sizeof( Ts ) )... };
+    };
+
+    // Streams are stored as encoded, so captures only replay on builds with the same record layout
+    constexpr auto capture_layout( ) noexcept -> uint32_t {
+        uint32_t hash = 2166136261u;
+        for ( const auto size : record_sizes<Command>::value ) {
+            hash = ( hash ^ size ) * 16777619u;
+        }
+        for ( const auto size : record_sizes<UniformValue>::value ) {
+            hash = ( hash ^ size ) * 16777619u;
+        }
+        return hash;
+    }
+
+    // Calls f( kind, id ) with a pointer to every object id stored in the record
+    template <typename F> inline auto visit_capture_ids( const CommandRecord& r, F&& f ) -> void {
+        if ( const auto c = r.get_if<ClearCommand>( ); c ) {
+            f( CaptureResource::framebuffer, &c->fb );
+        } else if ( const auto b = r.get_if<BindBufferCommand>( ); b ) {
+            f( CaptureResource::buffer, &b->id );
+        } else if ( const auto p = r.get_if<BindProgramCommand>( ); p ) {
+            f( CaptureResource::program_pipeline, &p->id );
+        } else if ( const auto va = r.get_if<BindVertexArrayCommand>( ); va ) {
+            f( CaptureResource::geometry, &va->id );
+        } else if ( const auto t = r.get_if<BindTextureCommand>( ); t ) {
+            f( CaptureResource::texture, &t->id );
+        } else if ( const auto fb = r.get_if<BindFramebufferCommand>( ); fb ) {
+            f( CaptureResource::framebuffer, &fb->id );
+        } else if ( const auto bl = r.get_if<BlitFramebufferCommand>( ); bl ) {
+            f( CaptureResource::framebuffer, &bl->src );
+            f( CaptureResource::framebuffer, &bl->dst );
+        } else if ( r.is<SetUniformCommand>( ) ) {
+            f( CaptureResource::shader, &r.as<UniformRecord>( ).pid );
+        }
+    }
+
+    inline auto validate_capture_stream( const std::byte* data, size_t size, uint32_t count ) noexcept -> bool {
+        constexpr auto sizes = record_sizes<Command>::value;
+        constexpr auto value_sizes = record_sizes<UniformValue>::value;
+
+        size_t offset = 0;
+        uint32_t n = 0;
+        while ( offset < size ) {
+            CommandHeader h;
+            if ( size - offset < sizeof h )
+                return false;
+
+            memcpy( &h, data + offset, sizeof h );
+            if ( h.type >= sizes.size( ) || h.size % CommandStream::alignment != 0
+                || h.size < sizeof h + sizes[h.type] || h.size > size - offset )
+                return false;
+
+            if ( h.type == variant_index_v<SetUniformCommand, Command> ) {
+                UniformRecord u;
+                memcpy( &u, data + offset + sizeof h, sizeof u );
+                if ( u.kind >= value_sizes.size( ) || h.size < sizeof h + sizeof u + value_sizes[u.kind] )
+                    return false;
+            }
+
+            offset += h.size;
+            n++;
+        }
+
+        return n == count;
+    }
+
+    // Keys under which commands reference the resource, geometry is also reachable through its buffers
+    inline auto capture_provides( const CaptureEntry& e ) noexcept -> std::array<uint64_t, 3> {
+        if ( e.kind == CaptureResource::geometry || e.kind == CaptureResource::geometry_pool ) {
+            return { capture_key( CaptureResource::geometry, e.ids[0] ),
+                capture_key( CaptureResource::buffer, e.ids[1] ), capture_key( CaptureResource::buffer, e.ids[2] ) };
+        }
+
+        const auto key = capture_key( e.kind, e.ids[0] );
+        return { key, key, key };
+    }
+
+    inline auto read_back_buffer( CaptureWriter& w, uint32_t buffer, size_t size, size_t from = 0 ) -> void {
+        const auto offset = w.bytes.size( );
+        w.bytes.resize( offset + size );
+        if ( size > 0 ) {
+            glGetNamedBufferSubData( buffer, static_cast<GLintptr>( from ), static_cast<GLsizeiptr>( size ),
+                w.bytes.data( ) + offset );
+        }
+    }
+
+    // Sized like a written vector, so the loader reads it back as one
+    inline auto read_back_vector( CaptureWriter& w, uint32_t buffer, size_t size ) -> void {
+        w.write( static_cast<uint32_t>( buffer != 0 ? size : 0 ) );
+        if ( buffer != 0 ) {
+            read_back_buffer( w, buffer, size );
+        }
+    }
+
+    // Writes every range outside the free list followed by its contents, pools without indices have no capacity
+    inline auto read_back_ranges( CaptureWriter& w, uint32_t buffer, uint32_t capacity, size_t element_size,
+        const std::vector<GeometryRange>& free ) -> void {
+        std::vector<GeometryRange> used;
+        uint32_t cursor = 0;
+        for ( const auto& f : free ) {
+            if ( f.offset > cursor ) {
+                used.push_back( { cursor, f.offset - cursor } );
+            }
+            cursor = f.offset + f.count;
+        }
+        if ( cursor < capacity ) {
+            used.push_back( { cursor, capacity - cursor } );
+        }
+
+        w.write( static_cast<uint32_t>( used.size( ) ) );
+        for ( const auto& r : used ) {
+            w.write( r );
+            read_back_buffer( w, buffer, r.count * element_size, r.offset * element_size );
+        }
+    }
+
+    // Level 0 of every layer that was created with pixels, the others stay empty
+    inline auto read_back_texture( CaptureWriter& w, const CaptureEntry& e ) -> void {
+        CaptureReader in { e.info.bytes.data( ), e.info.bytes.size( ) };
+        CaptureTextureInfo t;
+        uint32_t layers = 0;
+        in.read( t );
+        in.read( layers );
+        w.write( t );
+        w.write( layers );
+
+        GLint internal_format = 0;
+        GLenum format = 0, type = 0;
+        get_texture_format_from_pixelformat( t.format, internal_format, format, type );
+        const auto size = size_t { t.width } * t.height * pixel_size( t.format );
+
+        glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+        for ( uint32_t layer = 0; layer < layers; layer++ ) {
+            uint8_t filled = 0;
+            in.read( filled );
+            w.write( static_cast<uint32_t>( filled ? size : 0 ) );
+            if ( !filled )
+                continue;
+
+            const auto offset = w.bytes.size( );
+            w.bytes.resize( offset + size );
+            glGetTextureSubImage( e.ids[0], 0, 0, 0, static_cast<GLint>( layer ), static_cast<GLsizei>( t.width ),
+                static_cast<GLsizei>( t.height ), 1, format, type, static_cast<GLsizei>( size ),
+                w.bytes.data( ) + offset );
+        }
+        glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+    }
+
+    struct CaptureIdMap {
+        auto add( CaptureResource kind, uint32_t from, uint32_t to ) -> void {
+            if ( from != 0 ) {
+                ids[capture_key( kind, from )] = to;
+            }
+        }
+
+        auto remap( CaptureResource kind, uint32_t id ) -> uint32_t {
+            if ( id == 0 )
+                return 0;
+
+            if ( const auto it = ids.find( capture_key( kind, id ) ); it != ids.end( ) )
+                return it->second;
+
+            missing++;
+            return 0;
+        }
+
+        std::unordered_map<uint64_t, uint32_t> ids;
+        uint32_t missing = 0;
+    };
+
+} // namespace detail
+
+// Records creation calls from now on, resources created while disabled can't be written to a capture
+inline auto enable_capture( bool enable ) -> void {
+    detail::capture_registry.enabled = enable;
+    if ( !enable ) {
+        detail::capture_registry.entries.clear( );
+        detail::capture_registry.pools.clear( );
+    }
+}
+
+// Writes the queues and the creation calls of every resource they reference, contents are read back
+inline auto write_capture( const std::string& path, const CommandQueues& queues ) -> bool {
+    using namespace detail;
+
+    std::unordered_set<uint64_t> refs;
+    for ( const auto q : queues ) {
+        for ( const auto r : q->commands ) {
+            visit_capture_ids( r, [&]( CaptureResource kind, const uint32_t* id ) {
+                if ( *id != 0 ) {
+                    refs.insert( capture_key( kind, *id ) );
+                }
+            } );
+        }
+    }
+
+    // Dependencies are created before their users, so a single backward pass pulls them in
+    std::vector<const CaptureEntry*> used;
+    std::unordered_set<uint64_t> provided;
+    const auto& entries = capture_registry.entries;
+    for ( auto it = entries.rbegin( ); it != entries.rend( ); ++it ) {
+        const auto& e = *it;
+        const auto keys = capture_provides( e );
+        if ( std::none_of( keys.begin( ), keys.end( ), [&]( uint64_t key ) { return refs.contains( key ); } ) )
+            continue;
+
+        used.push_back( &e );
+        provided.insert( keys.begin( ), keys.end( ) );
+
+        for ( const auto& d : e.deps ) {
+            if ( d.id != 0 ) {
+                refs.insert( capture_key( d.kind, d.id ) );
+            }
+        }
+    }
+
+    std::reverse( used.begin( ), used.end( ) );
+
+    const auto missing
+        = std::count_if( refs.begin( ), refs.end( ), [&]( uint64_t key ) { return !provided.contains( key ); } );
+    if ( missing > 0 ) {
+        journal::warning( GRAPHICS_TAG, "Capture {} misses {} resources created while capture was disabled", path,
+            missing );
+    }
+
+    CaptureWriter out;
+    out.write( CaptureHeader { CAPTURE_MAGIC, CAPTURE_VERSION, capture_layout( ), default_framebuffer.width,
+        default_framebuffer.height, static_cast<uint32_t>( used.size( ) ), static_cast<uint32_t>( queues.size( ) ) } );
+
+    for ( const auto e : used ) {
+        out.write( e->kind );
+        out.write( e->ids );
+
+        // Contents change after creation and aren't copied while recording, so they are read back now
+        CaptureWriter blob;
+        if ( e->kind == CaptureResource::texture ) {
+            read_back_texture( blob, *e );
+        } else {
+            blob = e->info;
+        }
+
+        if ( e->kind == CaptureResource::buffer ) {
+            uint32_t size = 0;
+            memcpy( &size, e->info.bytes.data( ), sizeof size );
+            read_back_buffer( blob, e->ids[0], size );
+        } else if ( e->kind == CaptureResource::geometry ) {
+            CaptureGeometryInfo g;
+            memcpy( &g, e->info.bytes.data( ), sizeof g );
+            read_back_vector( blob, e->ids[1], g.vertices_num * vertex_size( g.format ) );
+            read_back_vector( blob, e->ids[2], g.indices_num * index_size( g.index_type ) );
+        } else if ( e->kind == CaptureResource::geometry_pool ) {
+            CreateGeometryPoolInfo info;
+            memcpy( &info, e->info.bytes.data( ), sizeof info );
+            const auto& [free_vertices, free_indices] = capture_registry.pools[e->ids[0]];
+            read_back_ranges( blob, e->ids[1], info.vertex_capacity, vertex_size( info.format ), free_vertices );
+            read_back_ranges( blob, e->ids[2], info.index_capacity, index_size( info.index_type ), free_indices );
+        }
+
+        out.write( static_cast<uint32_t>( blob.bytes.size( ) ) );
+        out.append( blob.bytes.data( ), blob.bytes.size( ) );
+    }
+
+    for ( const auto q : queues ) {
+        out.write( CaptureQueueInfo { q->sorted, q->coalesce_draws, q->color_blend, q->rasterizer, q->depth_stencil,
+            static_cast<uint32_t>( q->commands.size( ) ), static_cast<uint32_t>( q->commands.size_bytes( ) ) } );
+        out.append( q->commands.data( ), q->commands.size_bytes( ) );
+    }
+
+    std::ofstream fs( path, std::ios::binary );
+    if ( !fs.write(
+             reinterpret_cast<const char*>( out.bytes.data( ) ), static_cast<std::streamsize>( out.bytes.size( ) ) ) ) {
+        journal::warning( GRAPHICS_TAG, "Couldn't write capture {}", path );
+        return false;
+    }
+
+    return true;
+}
+
+inline auto destroy_capture( Capture& capture ) -> void {
+    for ( auto& p : capture.pipelines ) {
+        destroy_program_pipeline( p );
+    }
+    for ( auto& fb : capture.framebuffers ) {
+        destroy_framebuffer( fb );
+    }
+    for ( auto& s : capture.shaders ) {
+        destroy_shader( s );
+    }
+    for ( auto& t : capture.textures ) {
+        destroy_texture( t );
+    }
+    for ( auto& rb : capture.renderbuffers ) {
+        destroy_renderbuffer( rb );
+    }
+    for ( auto& b : capture.buffers ) {
+        destroy_buffer( b );
+    }
+    for ( auto& g : capture.geometries ) {
+        destroy_geometry( g );
+    }
+    for ( auto& pool : capture.geometry_pools ) {
+        destroy_geometry_pool( pool );
+    }
+
+    capture = { };
+}
+
+namespace detail {
+
+    // Ranges written by read_back_ranges, the rest of the buffer stays undefined
+    inline auto load_capture_ranges( CaptureReader& in, uint32_t buffer, uint32_t capacity, size_t element_size )
+        -> bool {
+        uint32_t count = 0;
+        if ( !in.read( count ) )
+            return false;
+
+        for ( uint32_t i = 0; i < count; i++ ) {
+            GeometryRange r;
+            if ( !in.read( r ) || r.offset > capacity || r.count > capacity - r.offset )
+                return false;
+
+            const auto bytes = r.count * element_size;
+            const auto data = in.span( bytes );
+            if ( !data || buffer == 0 )
+                return false;
+
+            glNamedBufferSubData( buffer, static_cast<GLintptr>( r.offset * element_size ),
+                static_cast<GLsizeiptr>( bytes ), data );
+        }
+
+        return true;
+    }
+
+    inline auto load_capture_resource( CaptureReader& in, CaptureResource kind, const std::array<uint32_t, 3>& old,
+        Capture& capture, CaptureIdMap& ids ) -> bool {
+        switch ( kind ) {
+        case CaptureResource::texture: {
+            CaptureTextureInfo t;
+            uint32_t layers = 0;
+            if ( !in.read( t ) || !in.read( layers ) || layers > in.remaining( ) / sizeof( uint32_t ) )
+                return false;
+
+            std::vector<u8_buffer> pixels( layers );
+            for ( auto& p : pixels ) {
+                in.read( p );
+            }
+            if ( !in.is_ok( ) )
+                return false;
+
+            Texture texture;
+            if ( t.target == GL_TEXTURE_2D ) {
+                texture = create_texture( { t.width, t.height, t.depth, t.format, t.mipmaps, t.levels, t.filter,
+                    pixels.empty( ) ? u8_buffer { } : std::move( pixels[0] ) } );
+            } else {
+                const auto cube = t.target == GL_TEXTURE_CUBE_MAP;
+                pixels.resize( std::max<size_t>( pixels.size( ), cube ? 6 : t.depth ) );
+
+                const CreateTextureArrayInfo info {
+                    t.width, t.height, t.depth, t.format, t.mipmaps, t.levels, t.filter, std::move( pixels ) };
+                texture = cube ? create_texture_cube( info ) : create_texture_array( info );
+            }
+
+            ids.add( kind, old[0], texture.id );
+            capture.textures.push_back( texture );
+            return true;
+        }
+        case CaptureResource::renderbuffer: {
+            CreateRenderBufferInfo info;
+            if ( !in.read( info ) )
+                return false;
+
+            const auto rb = create_renderbuffer( info );
+            ids.add( kind, old[0], rb.id );
+            capture.renderbuffers.push_back( rb );
+            return true;
+        }
+        case CaptureResource::framebuffer: {
+            CreateFramebufferInfo info;
+            if ( !in.read( info.width ) || !in.read( info.height ) || !in.read( info.attachments ) )
+                return false;
+
+            for ( auto& a : info.attachments ) {
+                a.render_target = ids.remap(
+                    a.attachment_target == GL_RENDERBUFFER ? CaptureResource::renderbuffer : CaptureResource::texture,
+                    a.render_target );
+            }
+
+            const auto fb = create_framebuffer( info );
+            ids.add( kind, old[0], fb.id );
+            capture.framebuffers.push_back( fb );
+            return true;
+        }
+        case CaptureResource::shader: {
+            CreateShaderInfo info;
+            if ( !in.read( info.type ) || !in.read( info.source ) )
+                return false;
+
+            const auto shader = create_shader( info );
+            ids.add( kind, old[0], shader.id );
+            capture.shaders.push_back( shader );
+            return true;
+        }
+        case CaptureResource::program_pipeline: {
+            CreatePipelineInfo info;
+            if ( !in.read( info.shaders ) )
+                return false;
+
+            for ( auto& s : info.shaders ) {
+                s.id = ids.remap( CaptureResource::shader, s.id );
+            }
+
+            auto pipeline = create_program_pipeline( info );
+            ids.add( kind, old[0], pipeline.id );
+            capture.pipelines.push_back( std::move( pipeline ) );
+            return true;
+        }
+        case CaptureResource::buffer: {
+            uint32_t size = 0;
+            if ( !in.read( size ) )
+                return false;
+
+            const auto data = in.span( size );
+            if ( !data )
+                return false;
+
+            std::vector<std::byte> contents( data, data + size );
+            const auto buffer = create_buffer( { contents.data( ), contents.size( ) } );
+            ids.add( kind, old[0], buffer.id );
+            capture.buffers.push_back( buffer );
+            return true;
+        }
+        case CaptureResource::geometry: {
+            CaptureGeometryInfo g;
+            CreateGeometryInfo info;
+            std::vector<std::byte> indices;
+            if ( !in.read( g ) || !in.read( info.vertices ) || !in.read( indices ) )
+                return false;
+
+            info.vertices_num = g.vertices_num;
+            info.indices_num = g.indices_num;
+            info.min = g.min;
+            info.max = g.max;
+            info.format = g.format;
+
+            const auto geometry = create_geometry(
+                info, std::as_bytes( std::span { info.vertices } ), IndexSpan { indices, g.index_type } );
+            ids.add( kind, old[0], geometry.vao );
+            ids.add( CaptureResource::buffer, old[1], geometry.vb );
+            ids.add( CaptureResource::buffer, old[2], geometry.eb );
+            capture.geometries.push_back( geometry );
+            return true;
+        }
+        case CaptureResource::geometry_pool: {
+            CreateGeometryPoolInfo info;
+            if ( !in.read( info ) )
+                return false;
+
+            auto pool = create_geometry_pool( info );
+            const auto vertices
+                = load_capture_ranges( in, pool.vb, pool.vertex_capacity, vertex_size( pool.format ) );
+            const auto indices
+                = load_capture_ranges( in, pool.eb, pool.index_capacity, index_size( pool.index_type ) );
+            if ( !pool.is_valid( ) || !vertices || !indices ) {
+                destroy_geometry_pool( pool );
+                return false;
+            }
+
+            ids.add( CaptureResource::geometry, old[0], pool.vao );
+            ids.add( CaptureResource::buffer, old[1], pool.vb );
+            ids.add( CaptureResource::buffer, old[2], pool.eb );
+            capture.geometry_pools.push_back( std::move( pool ) );
+            return true;
+        }
+        }
+
+        return false;
+    }
+
+} // namespace detail
+
+// Recreates the captured resources and queues, ids in the recorded commands are remapped to the new objects
+inline auto load_capture( const std::string& path ) -> std::optional<Capture> {
+    using namespace detail;
+
+    std::ifstream fs( path, std::ios::binary | std::ios::ate );
+    if ( !fs.is_open( ) ) {
+        journal::warning( GRAPHICS_TAG, "Couldn't open capture {}", path );
+        return { };
+    }
+
+    std::vector<std::byte> file( static_cast<size_t>( fs.tellg( ) ) );
+    fs.seekg( 0 );
+    fs.read( reinterpret_cast<char*>( file.data( ) ), static_cast<std::streamsize>( file.size( ) ) );
+
+    CaptureReader in { file.data( ), file.size( ) };
+
+    CaptureHeader header;
+    if ( !in.read( header ) || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION
+        || header.layout != capture_layout( ) ) {
+        journal::warning( GRAPHICS_TAG, "Capture {} has an unsupported format", path );
+        return { };
+    }
+
+    Capture capture;
+    capture.width = header.width;
+    capture.height = header.height;
+
+    CaptureIdMap ids;
+
+    auto ok = true;
+    for ( uint32_t i = 0; ok && i < header.num_resources; i++ ) {
+        CaptureResource kind;
+        std::array<uint32_t, 3> old;
+        uint32_t size = 0;
+        in.read( kind );
+        in.read( old );
+        in.read( size );
+
+        const auto bytes = in.span( size );
+        CaptureReader resource { bytes, bytes ? size : 0 };
+        ok = bytes && load_capture_resource( resource, kind, old, capture, ids );
+    }
+
+    ok = ok && header.num_queues <= in.remaining( ) / sizeof( CaptureQueueInfo );
+    if ( ok ) {
+        capture.queues.resize( header.num_queues );
+    }
+
+    for ( size_t i = 0; ok && i < capture.queues.size( ); i++ ) {
+        CaptureQueueInfo info;
+        const auto stream = in.read( info ) ? in.span( info.size_bytes ) : nullptr;
+        ok = stream && validate_capture_stream( stream, info.size_bytes, info.num_commands );
+        if ( !ok )
+            break;
+
+        auto& q = capture.queues[i];
+        q.presentation_clear = false; // Replayed every present
+        q.sorted = info.sorted;
+        q.coalesce_draws = info.coalesce_draws;
+        q.color_blend = info.color_blend;
+        q.rasterizer = info.rasterizer;
+        q.depth_stencil = info.depth_stencil;
+        q.commands.assign( stream, info.size_bytes, info.num_commands );
+
+        for ( const auto r : q.commands ) {
+            visit_capture_ids( r, [&]( CaptureResource kind, const uint32_t* field ) {
+                const auto id = ids.remap( kind, *field );
+                q.commands.patch(
+                    static_cast<uint32_t>( reinterpret_cast<const std::byte*>( field ) - q.commands.data( ) ), &id,
+                    sizeof id );
+            } );
+        }
+
+        capture.pointers.push_back( &q );
+    }
+
+    if ( !ok ) {
+        journal::warning( GRAPHICS_TAG, "Capture {} is damaged", path );
+        destroy_capture( capture );
+        return { };
+    }
+
+    if ( ids.missing > 0 ) {
+        journal::warning( GRAPHICS_TAG, "Capture {} references {} resources it doesn't contain", path, ids.missing );
+    }
+
+    return capture;
 }
 
 namespace extention {
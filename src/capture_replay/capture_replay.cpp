@@ -0,0 +1,110 @@
+#include <application.hpp>
+#include <graphics.hpp>
+
+#include <chrono>
+#include <string>
+
+constexpr char REPLAY_TITLE[] = "CaptureReplay";
+
+// Presents a capture written by gfx::write_capture as fast as possible and reports the frame times
+int main( int argc, char* argv[] ) {
+    using namespace std::chrono;
+
+    if ( argc < 2 ) {
+        journal::info( REPLAY_TITLE, "Usage: capture_replay <capture> [frames] [opengl|null|counting]" );
+        return EXIT_FAILURE;
+    }
+
+    const auto path = std::string { argv[1] };
+    const auto num_frames = argc > 2 ? std::stoul( argv[2] ) : 1000ul;
+    const auto backend = std::string_view { argc > 3 ? argv[3] : "opengl" };
+
+    std::optional<application::Window> window;
+
+    if ( backend == "null" ) {
+        gfx::set_backend( gfx::Backend::null );
+    } else if ( backend == "counting" ) {
+        gfx::set_backend( gfx::Backend::counting );
+    } else {
+        glfwSetErrorCallback( []( int error, const char* description ) {
+            journal::error( REPLAY_TITLE, "Error {} {}", error, description );
+        } );
+
+        if ( !glfwInit( ) )
+            return EXIT_FAILURE;
+        atexit( glfwTerminate );
+
+        window = application::create_window( { .width = 1440, .height = 1080, .debug = false, .title = REPLAY_TITLE } );
+        if ( !window ) {
+            journal::error( REPLAY_TITLE, "Couldn't create window" );
+            return EXIT_FAILURE;
+        }
+
+        gfx::default_framebuffer.width = window->width;
+        gfx::default_framebuffer.height = window->height;
+    }
+
+    auto capture = gfx::load_capture( path );
+    if ( !capture ) {
+        journal::error( REPLAY_TITLE, "Couldn't load {}", path );
+        return EXIT_FAILURE;
+    }
+
+    journal::info( REPLAY_TITLE, "{} captured at {}x{}, {} queues, {} geometries, {} textures, {} pipelines", path,
+        capture->width, capture->height, capture->queues.size( ), capture->geometries.size( ),
+        capture->textures.size( ), capture->pipelines.size( ) );
+
+    const auto& memory = gfx::memory_stats( );
+    journal::info( REPLAY_TITLE, "{} KiB in {} allocations, textures {} KiB, renderbuffers {} KiB, buffers {} KiB, "
+                                 "geometry {} KiB",
+        memory.total.bytes / 1024, memory.total.allocations,
+        gfx::memory_usage( gfx::MemoryCategory::texture ).bytes / 1024,
+        gfx::memory_usage( gfx::MemoryCategory::renderbuffer ).bytes / 1024,
+        gfx::memory_usage( gfx::MemoryCategory::buffer ).bytes / 1024,
+        gfx::memory_usage( gfx::MemoryCategory::geometry ).bytes / 1024 );
+
+    nanoseconds present_time { 0 };
+    nanoseconds frame_time { 0 };
+    nanoseconds worst_frame { 0 };
+
+    for ( size_t frame = 0; frame < num_frames; frame++ ) {
+        gfx::reset_backend_counts( );
+
+        const auto start = high_resolution_clock::now( );
+
+        gfx::present( capture->pointers );
+
+        const auto presented = high_resolution_clock::now( );
+
+        if ( window ) {
+            application::process_window( *window );
+        }
+
+        const auto end = high_resolution_clock::now( );
+
+        present_time += presented - start;
+        frame_time += end - start;
+        worst_frame = std::max( worst_frame, nanoseconds { end - start } );
+    }
+
+    const auto& stats = gfx::present_stats( );
+
+    journal::info( REPLAY_TITLE, "{} frames, present {:.3f} ms/frame, frame {:.3f} ms/frame, worst {:.3f} ms",
+        num_frames, duration<double, std::milli>( present_time ).count( ) / num_frames,
+        duration<double, std::milli>( frame_time ).count( ) / num_frames,
+        duration<double, std::milli>( worst_frame ).count( ) );
+    journal::info( REPLAY_TITLE, "state calls issued {}, saved {}, multi draws {}, coalesced draws {}",
+        stats.issued_calls, stats.saved_calls, stats.multi_draws, stats.coalesced_draws );
+
+    for ( const auto& c : gfx::backend_call_counts( ) ) {
+        journal::info( REPLAY_TITLE, "{} {}", c.name, c.count );
+    }
+
+    gfx::destroy_capture( *capture );
+
+    if ( window ) {
+        application::destroy_window( *window );
+    }
+
+    return EXIT_SUCCESS;
+}
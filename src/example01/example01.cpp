@@ -30,7 +30,7 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 commands << gfx::bind_vao { geomerty };
                 commands << gfx::draw_elements { .num_elements = 3 };
 
-                gfx::present( { &commands } );
+                example.present( { &commands } );
             },
         .on_cleanup = [&]( ) { gfx::destroy_geometry( geomerty ); } } );
 }
\ No newline at end of file
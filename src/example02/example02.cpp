@@ -43,6 +43,8 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
     gfx::Shader vertex_shader;
     gfx::Shader fragment_shader;
     gfx::ProgramPipeline pipeline;
+    gfx::CommandBundle cube_bundle;
+    gfx::BundleParameter cube_mvp;
     gfx::CommandQueue commands;
 
     float angle = 0.f;
@@ -57,10 +59,9 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 commands.depth_stencil.depth_write = true;
 
                 geomerty = gfx::create_geometry( { .vertices_num = CUBE_NUM_VERTICES,
-                    .indices_num = CUBE_NUM_INDICES,
-                    .format = gfx::VertexFormat::v3t2n3_f32ui16,
-                    .vertices = utility::make_buffer( cube_vertices ),
-                    .indices = utility::make_vector( cube_indices ) } );
+                                                     .indices_num = CUBE_NUM_INDICES,
+                                                     .format = gfx::VertexFormat::v3t2n3_f32ui16 },
+                    std::as_bytes( std::span { cube_vertices } ), cube_indices );
 
                 vertex_shader = gfx::create_shader( { .type = gfx::ShaderType::vertex, .source = VERTEX_SHADER } );
 
@@ -71,13 +72,18 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 std::ifstream fs( "../textures/texture.tga", std::ios::in | std::ios::binary );
                 auto image = gfx::load_targa( fs );
                 if ( image ) {
-                    texture = gfx::create_texture( { .width = image->width,
-                        .height = image->height,
-                        .format = image->format,
-                        .pixels = image->pixels } );
+                    texture = gfx::create_texture(
+                        { .width = image->width, .height = image->height, .format = image->format },
+                        std::as_bytes( std::span { image->pixels } ) );
                 } else {
                     journal::error( EXAMPLE_TITLE, "Failed to load image" );
                 }
+
+                cube_bundle << gfx::bind_pipeline { pipeline };
+                cube_bundle << gfx::bind_texture { 0, texture.id };
+                cube_bundle << gfx::set_uniform { pipeline, "color", vec3 { 1.0f, 1.0f, 1.0f } };
+                cube_mvp = cube_bundle.parameter( gfx::get_uniform( pipeline, "mvp" ), mat4 { 1.f } );
+                cube_bundle << gfx::draw_geometry { geomerty };
             },
         .on_update = [&]( ) { angle += 0.01f; },
         .on_present =
@@ -95,13 +101,10 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 const auto mvp = projection * view * model;
 
                 commands << gfx::clear_framebuffer { { 0.4, 0.4, 0.4, 1 } };
-                commands << gfx::bind_pipeline { pipeline };
-                commands << gfx::bind_texture { 0, texture.id };
-                commands << gfx::set_uniform { pipeline, "mvp", mvp };
-                commands << gfx::set_uniform { pipeline, "color", vec3 { 1.0f, 1.0f, 1.0f } };
-                commands << gfx::draw_geometry { geomerty };
+                cube_bundle.set( cube_mvp, mvp );
+                commands << cube_bundle;
 
-                gfx::present( { &commands } );
+                example.present( { &commands } );
             },
         .on_cleanup =
             [&]( ) {
@@ -110,5 +113,6 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 gfx::destroy_shader( fragment_shader );
                 gfx::destroy_program_pipeline( pipeline );
                 gfx::destroy_texture( texture );
-            } } );
+            },
+        .render_thread = true } );
 }
\ No newline at end of file
@@ -3,17 +3,18 @@
 
 constexpr char EXAMPLE_TITLE[] = "Example03";
 
-constexpr char VERTEX_SHADER[] = "#version 450 core\n"
-                                 "#define MAX_INSTANCES 6\n"
+constexpr char VERTEX_SHADER[] = "#version 460 core\n"
 
                                  "layout(location = 0) in vec3 position;"
                                  "layout(location = 1) in vec2 texcoord;"
                                  "layout(location = 2) in vec3 normal;"
 
                                  "uniform mat4 projection_view;"
+                                 "uniform mat4 dequantize;" // Positions are snorm16 in the mesh bounds
 
-                                 "layout (std140, binding = 0) uniform MatrixBlock {"
-                                 "mat4 model[MAX_INSTANCES];"
+                                 // One entry per draw, indexed by the base instance of the draw
+                                 "layout (std430, binding = 0) readonly buffer DrawBlock {"
+                                 "mat4 model[];"
                                  "};"
 
                                  "out gl_PerVertex {"
@@ -28,10 +29,10 @@ constexpr char VERTEX_SHADER[] = "#version 450 core\n"
 
                                  "void main () {"
                                  "  vs_out.texcoord = texcoord;"
-                                 "  vs_out.normal = vec3(model[gl_InstanceID] * vec4(normal, 0));"
-                                 "  vs_out.index = gl_InstanceID;"
-                                 "  gl_Position = projection_view * model[gl_InstanceID] * vec4(position, "
-                                 "1.0);"
+                                 "  vs_out.normal = vec3(model[gl_BaseInstance] * vec4(normal, 0));"
+                                 "  vs_out.index = gl_BaseInstance;"
+                                 "  gl_Position = projection_view * model[gl_BaseInstance] * dequantize * "
+                                 "vec4(position, 1.0);"
                                  "}";
 
 constexpr char FRAGMENT_SHADER[] = "#version 450 core\n"
@@ -76,7 +77,9 @@ const std::array<Material, 6> materials { Material { { 1.f, 0.f, 0.f, 1.f }, 0.f
 int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
     gfx::Geometry geomerty;
     gfx::Texture texture;
-    gfx::Buffer matrix_buffer;
+    gfx::RingBuffer matrix_ring;
+    gfx::DrawDataStream<mat4> draw_data;
+    gfx::UploadQueue uploads;
     gfx::Buffer material_buffer;
     gfx::Shader vertex_shader;
     gfx::Shader fragment_shader;
@@ -84,6 +87,7 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
     gfx::CommandQueue commands;
 
     float angle = 0.f;
+    std::array<mat4, 6> models = { mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f } };
 
     ExampleApp example;
     return example.run( { .title = EXAMPLE_TITLE,
@@ -93,12 +97,13 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
 
                 commands.depth_stencil.depth_test = true;
                 commands.depth_stencil.depth_write = true;
+                commands.coalesce_draws = true;
 
                 geomerty = gfx::create_geometry( { .vertices_num = CUBE_NUM_VERTICES,
-                    .indices_num = CUBE_NUM_INDICES,
-                    .format = gfx::VertexFormat::v3t2n3_f32ui16,
-                    .vertices = utility::make_buffer( cube_vertices ),
-                    .indices = utility::make_vector( cube_indices ) } );
+                                                     .indices_num = CUBE_NUM_INDICES,
+                                                     .format = gfx::VertexFormat::v3t2n3_f32ui16,
+                                                     .quantize = true },
+                    std::as_bytes( std::span { cube_vertices } ), cube_indices );
 
                 vertex_shader = gfx::create_shader( { .type = gfx::ShaderType::vertex, .source = VERTEX_SHADER } );
 
@@ -120,28 +125,32 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                         image_width = image.value( ).width;
                         image_height = image.value( ).height;
                         image_format = image.value( ).format;
-                        pix_images.push_back( image.value( ).pixels );
+                        pix_images.push_back( std::move( image->pixels ) );
                     } else {
                         journal::error( EXAMPLE_TITLE, "Failed to load image '{}'", n );
                     }
                 }
 
-                if ( !pix_images.empty( ) ) {
-                    texture = gfx::create_texture_array( { .width = image_width,
-                        .height = image_height,
-                        .depth = static_cast<uint32_t>( pix_images.size( ) ),
-                        .format = image_format,
-                        .pixels = pix_images } );
+                // Layers are streamed over the first frames instead of stalling the start up
+                uploads = gfx::create_upload_queue( { .frame_budget = 1 << 20 } );
+                std::vector<gfx::byte_span> layers;
+                for ( const auto& pixels : pix_images ) {
+                    layers.push_back( std::as_bytes( std::span { pixels } ) );
                 }
 
-                matrix_buffer = gfx::create_buffer( { .size = sizeof( mat4 ) * 6 } );
-                material_buffer = gfx::create_buffer( { .size = sizeof materials } );
+                if ( !layers.empty( ) ) {
+                    texture = gfx::create_texture_array( uploads,
+                        { .width = image_width,
+                            .height = image_height,
+                            .depth = static_cast<uint32_t>( layers.size( ) ),
+                            .format = image_format },
+                        layers );
+                }
 
-                std::array<mat4, 6> models
-                    = { mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f }, mat4 { 1.f } };
+                matrix_ring = gfx::create_ring_buffer( { .size = sizeof models } );
+                material_buffer = gfx::create_buffer( { .size = sizeof materials } );
 
                 gfx::update_buffer( material_buffer, materials );
-                gfx::update_buffer( matrix_buffer, models );
             },
         .on_update =
             [&]( ) {
@@ -149,7 +158,6 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
 
                 angle += 0.01f;
 
-                std::array<mat4, 6> models;
                 const vec3 angles[6] = {
                     { 0, 1, 1 },
                     { 1, 0, -1 },
@@ -166,8 +174,6 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                     models[i] = rotate( models[i], angle * angles[i][2], vec3( 0, 0, 1 ) );
                     models[i] = scale( models[i], vec3( 1.f ) );
                 }
-
-                gfx::update_buffer( matrix_buffer, models );
             },
         .on_present =
             [&]( auto w, auto h ) {
@@ -177,15 +183,30 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 auto view = translate( mat4( 1.f ), vec3( 0, 0, -10.f ) );
                 const auto projection_view = projection * view;
 
+                gfx::flush_uploads( uploads );
+
+                gfx::begin_ring_frame( matrix_ring );
+                draw_data.begin( matrix_ring, static_cast<uint32_t>( models.size( ) ) );
+
                 commands << gfx::clear_framebuffer { { 0.4, 0.4, 0.4, 1 } };
                 commands << gfx::bind_pipeline { pipeline };
                 commands << gfx::bind_texture { 0, texture.id };
-                commands << gfx::bind_buffer { gfx::BufferType::Uniform, matrix_buffer, pipeline, "MatrixBlock" };
+                commands << gfx::bind_buffer { gfx::BufferType::Storage, draw_data.allocation( ), 0 };
                 commands << gfx::bind_buffer { gfx::BufferType::Uniform, material_buffer, pipeline, "MaterialBlock" };
-                commands << gfx::set_uniform { pipeline, "projection_view", projection_view };
-                commands << gfx::draw_geometry { geomerty, 6 };
+                commands << gfx::set_uniform { pipeline, gfx::uniform_name( "projection_view" ), projection_view };
+                commands << gfx::set_uniform {
+                    pipeline, gfx::uniform_name( "dequantize" ), geomerty.quantization.position_matrix( ) };
+
+                // One draw per cube, coalesced into a single multi draw that reads its matrix by base instance
+                for ( const auto& model : models ) {
+                    if ( const auto index = draw_data.push( model ); index ) {
+                        commands << gfx::draw_geometry { geomerty, 1, 0.f, *index };
+                    }
+                }
+
+                example.present( { &commands } );
 
-                gfx::present( { &commands } );
+                gfx::end_ring_frame( matrix_ring );
             },
         .on_cleanup =
             [&]( ) {
@@ -195,6 +216,7 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 gfx::destroy_program_pipeline( pipeline );
                 gfx::destroy_texture( texture );
                 gfx::destroy_buffer( material_buffer );
-                gfx::destroy_buffer( matrix_buffer );
+                gfx::destroy_ring_buffer( matrix_ring );
+                gfx::destroy_upload_queue( uploads );
             } } );
 }
\ No newline at end of file
@@ -77,6 +77,7 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
     gfx::Shader vertex_shader, post_vertex_shader;
     gfx::Shader fragment_shader, post_fragment_shader;
     gfx::ProgramPipeline pipeline, post_pipeline;
+    gfx::UniformHandle mvp_uniform, color_uniform;
     gfx::CommandQueue commands, post_commands;
     gfx::Framebuffer sample_framebuffer;
     gfx::Framebuffer simple_framebuffer;
@@ -99,16 +100,14 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 post_commands.depth_stencil.depth_write = true;
 
                 geomerty = gfx::create_geometry( { .vertices_num = CUBE_NUM_VERTICES,
-                    .indices_num = CUBE_NUM_INDICES,
-                    .format = gfx::VertexFormat::v3t2n3_f32ui16,
-                    .vertices = utility::make_buffer( cube_vertices ),
-                    .indices = utility::make_vector( cube_indices ) } );
+                                                     .indices_num = CUBE_NUM_INDICES,
+                                                     .format = gfx::VertexFormat::v3t2n3_f32ui16 },
+                    std::as_bytes( std::span { cube_vertices } ), cube_indices );
 
                 screenquad = gfx::create_geometry( { .vertices_num = QUAD_NUM_VERTICES,
-                    .indices_num = QUAD_NUM_INDICES,
-                    .format = gfx::VertexFormat::v3t2_f32ui16,
-                    .vertices = utility::make_buffer( quad_vertices ),
-                    .indices = utility::make_vector( quad_indices ) } );
+                                                       .indices_num = QUAD_NUM_INDICES,
+                                                       .format = gfx::VertexFormat::v3t2_f32ui16 },
+                    std::as_bytes( std::span { quad_vertices } ), quad_indices );
 
                 vertex_shader = gfx::create_shader( { .type = gfx::ShaderType::vertex, .source = VERTEX_SHADER } );
 
@@ -121,6 +120,8 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                     = gfx::create_shader( { .type = gfx::ShaderType::fragmet, .source = POST_FRAGMENT_SHADER } );
 
                 pipeline = gfx::create_program_pipeline( { .shaders = { vertex_shader, fragment_shader } } );
+                mvp_uniform = gfx::get_uniform( pipeline, "mvp" );
+                color_uniform = gfx::get_uniform( pipeline, "color" );
 
                 post_pipeline
                     = gfx::create_program_pipeline( { .shaders = { post_vertex_shader, post_fragment_shader } } );
@@ -187,8 +188,8 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 commands << gfx::bind_framebuffer { sample_framebuffer };
                 commands << gfx::clear_framebuffer { sample_framebuffer, { 0.4, 0.4, 0.4, 1 } };
                 commands << gfx::bind_pipeline { pipeline };
-                commands << gfx::set_uniform { pipeline, "mvp", mvp };
-                commands << gfx::set_uniform { pipeline, "color", vec3 { 1.0f, 1.0f, 0.0f } };
+                commands << gfx::set_uniform { mvp_uniform, mvp };
+                commands << gfx::set_uniform { color_uniform, vec3 { 1.0f, 1.0f, 0.0f } };
                 commands << gfx::draw_geometry { geomerty };
 
                 post_commands << gfx::blit_framebuffer { sample_framebuffer, simple_framebuffer };
@@ -198,7 +199,7 @@ int main( [[maybe_unused]] int argc, [[maybe_unused]] char* argv[] ) {
                 post_commands << gfx::bind_texture { 0, colortexture.id };
                 post_commands << gfx::draw_geometry { screenquad };
 
-                gfx::present( { &commands, &post_commands } );
+                example.present( { &commands, &post_commands } );
             },
         .on_cleanup =
             [&]( ) {
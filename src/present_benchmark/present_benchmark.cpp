@@ -0,0 +1,148 @@
+#include <application.hpp>
+#include <cube.hpp>
+#include <journal.hpp>
+
+#include <graphics.hpp>
+
+#include <chrono>
+#include <string>
+
+constexpr char BENCHMARK_TITLE[] = "PresentBenchmark";
+constexpr size_t NUM_MESHES = 16;
+
+// Measures the CPU cost of recording and presenting without a GL context
+int main( int argc, char* argv[] ) {
+    using namespace std::chrono;
+
+    const auto num_draws = argc > 1 ? std::stoul( argv[1] ) : 10000ul;
+    const auto num_frames = argc > 2 ? std::stoul( argv[2] ) : 100ul;
+    const auto mode = std::string_view { argc > 3 ? argv[3] : "" };
+
+    gfx::set_backend( gfx::Backend::counting );
+
+    // Draws cycle through several meshes, pooled meshes share one VAO
+    const auto pooled = mode.find( "pooled" ) != std::string_view::npos;
+    auto pool = gfx::create_geometry_pool( { .format = gfx::VertexFormat::v3t2n3_f32ui16 } );
+
+    const gfx::CreateGeometryInfo cube_info { .vertices_num = CUBE_NUM_VERTICES,
+        .indices_num = CUBE_NUM_INDICES,
+        .format = gfx::VertexFormat::v3t2n3_f32ui16 };
+    const auto vertices = std::as_bytes( std::span { cube_vertices } );
+
+    std::vector<gfx::Geometry> geometries;
+    for ( size_t i = 0; i < NUM_MESHES; i++ ) {
+        geometries.push_back( pooled ? gfx::create_geometry( pool, cube_info, vertices, cube_indices )
+                                     : gfx::create_geometry( cube_info, vertices, cube_indices ) );
+    }
+
+    auto vertex_shader = gfx::create_shader( { .type = gfx::ShaderType::vertex, .source = "" } );
+    auto fragment_shader = gfx::create_shader( { .type = gfx::ShaderType::fragmet, .source = "" } );
+    auto pipeline = gfx::create_program_pipeline( { .shaders = { vertex_shader, fragment_shader } } );
+
+    // The null backend reports no program resources, so the uniform is resolved by hand
+    const gfx::UniformHandle mvp_uniform { .pid = vertex_shader.id, .location = 0, .count = 1 };
+
+    gfx::CommandQueue commands;
+    commands.depth_stencil.depth_test = true;
+    commands.sorted = mode.find( "sorted" ) != std::string_view::npos;
+    commands.coalesce_draws = mode.find( "coalesce" ) != std::string_view::npos;
+
+    // Per-draw matrices packed into one storage block instead of a set_uniform per draw
+    const auto streamed = mode.find( "streamed" ) != std::string_view::npos;
+    auto ring = gfx::create_ring_buffer( { .size = sizeof( mat4 ) * num_draws } );
+    gfx::DrawDataStream<mat4> draw_data;
+
+    // Draws split into one contiguous chunk per worker, recorded concurrently and merged in chunk order
+    const auto parallel = mode.find( "parallel" ) != std::string_view::npos;
+    application::ThreadPool workers { parallel ? std::max( std::thread::hardware_concurrency( ), 2u ) - 1 : 0 };
+    gfx::SecondaryCommandBuffers secondary;
+    secondary.resize( workers.size( ) );
+
+    const auto record_draw = [&]( gfx::CommandQueue& buf, size_t i, uint32_t index ) {
+        buf << gfx::bind_pipeline { pipeline };
+        if ( streamed ) {
+            buf << gfx::draw_geometry { geometries[i % NUM_MESHES], 1, 0.f, index };
+        } else {
+            buf << gfx::set_uniform { mvp_uniform, mat4 { static_cast<float>( i ) } };
+            buf << gfx::draw_geometry { geometries[i % NUM_MESHES] };
+        }
+    };
+
+    nanoseconds record_time { 0 };
+    nanoseconds present_time { 0 };
+
+    for ( size_t frame = 0; frame < num_frames; frame++ ) {
+        gfx::reset_backend_counts( );
+
+        const auto start = high_resolution_clock::now( );
+
+        commands << gfx::clear_framebuffer { { 0.4, 0.4, 0.4, 1 } };
+        if ( streamed ) {
+            gfx::begin_ring_frame( ring );
+            draw_data.begin( ring, static_cast<uint32_t>( num_draws ) );
+            commands << gfx::bind_buffer { gfx::BufferType::Storage, draw_data.allocation( ), 0 };
+        }
+
+        if ( parallel ) {
+            // Draw data is written up front, so draw i reads entry i from every worker
+            for ( size_t i = 0; i < num_draws && streamed; i++ ) {
+                draw_data.push( mat4 { static_cast<float>( i ) } );
+            }
+
+            const auto chunk = ( num_draws + secondary.size( ) - 1 ) / secondary.size( );
+            workers.parallel_for( secondary.size( ), [&]( size_t w ) {
+                for ( auto i = w * chunk; i < std::min( num_draws, ( w + 1 ) * chunk ); i++ ) {
+                    record_draw( secondary[w], i, static_cast<uint32_t>( i ) );
+                }
+            } );
+            secondary.merge( commands );
+        } else {
+            for ( size_t i = 0; i < num_draws; i++ ) {
+                const auto index
+                    = streamed ? draw_data.push( mat4 { static_cast<float>( i ) } ) : std::optional<uint32_t> { 0 };
+                if ( index ) {
+                    record_draw( commands, i, *index );
+                }
+            }
+        }
+
+        const auto recorded = high_resolution_clock::now( );
+
+        gfx::present( { &commands } );
+
+        const auto presented = high_resolution_clock::now( );
+
+        if ( streamed ) {
+            gfx::end_ring_frame( ring );
+        }
+
+        record_time += recorded - start;
+        present_time += presented - recorded;
+    }
+
+    const auto& stats = gfx::present_stats( );
+
+    journal::info( BENCHMARK_TITLE, "{} draws, {} frames, sorted {}, coalesce {}, streamed {}, pooled {}, workers {}",
+        num_draws, num_frames, commands.sorted, commands.coalesce_draws, streamed, pooled,
+        parallel ? secondary.size( ) : 0 );
+    journal::info( BENCHMARK_TITLE, "record {:.3f} ms/frame, present {:.3f} ms/frame",
+        duration<double, std::milli>( record_time ).count( ) / num_frames,
+        duration<double, std::milli>( present_time ).count( ) / num_frames );
+    journal::info( BENCHMARK_TITLE, "state calls issued {}, saved {}, multi draws {}, coalesced draws {}",
+        stats.issued_calls, stats.saved_calls, stats.multi_draws, stats.coalesced_draws );
+
+    for ( const auto& c : gfx::backend_call_counts( ) ) {
+        journal::info( BENCHMARK_TITLE, "{} {}", c.name, c.count );
+    }
+
+    gfx::destroy_ring_buffer( ring );
+    for ( auto& g : geometries ) {
+        pooled ? gfx::destroy_geometry( pool, g ) : gfx::destroy_geometry( g );
+    }
+    gfx::destroy_geometry_pool( pool );
+    gfx::destroy_program_pipeline( pipeline );
+    gfx::destroy_shader( vertex_shader );
+    gfx::destroy_shader( fragment_shader );
+
+    return EXIT_SUCCESS;
+}